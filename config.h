@@ -35,6 +35,32 @@
 #define SELECTOR_SZ 1
 #define SELECTOR_COLOR TB_GREEN | TB_BOLD
 
+/* Marks entries picked with `--multi`, in the column after the selector. */
+#define PICKED "*"
+#define PICKED_COLOR TB_MAGENTA | TB_BOLD
+
 #define QUERY_PREFIX ">"
 #define QUERY_PREFIX_SZ 1
 #define QUERY_PREFIX_COLOR TB_YELLOW
+
+/*
+ * How often (in seconds) a long ranking shows what it has found so far.
+ * Under a frame, so the first matches appear right after a keystroke.
+ */
+#define PROGRESS_INTERVAL 0.008
+
+/*
+ * Most frames per second the finder draws; changes coming in faster are batched.
+ */
+#define FINDER_FPS 60
+
+/*
+ * `--preview`: how many preview commands may run at once, the most bytes of output
+ * kept from each, and the most kept in total, for entries selected again.
+ */
+#define PREVIEW_JOBS 4
+#define PREVIEW_MAX_BYTES (64 << 10)
+#define PREVIEW_CACHE_BYTES (8 << 20)
+
+#define PREVIEW_BORDER "|"
+#define PREVIEW_BORDER_COLOR TB_YELLOW
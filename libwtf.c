@@ -0,0 +1,2438 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "wtf.h"
+
+/*
+ * ALLOCATION
+ *
+ * All heap traffic (ours, cvector's and the caller's, if it likes) goes through
+ * these wrappers, so callers can tell how many allocations a phase really performed.
+ */
+wtf_stats_t wtf_stats = {0};
+
+#define stat_add(field, n) __atomic_fetch_add(&wtf_stats.field, (n), __ATOMIC_RELAXED)
+
+/* `allocs`, for the calling thread only. */
+static _Thread_local size_t thread_allocs;
+
+size_t
+wtf_thread_allocs(void)
+{
+  return thread_allocs;
+}
+
+void*
+wtf_malloc(size_t sz)
+{
+  stat_add(allocs, 1);
+  thread_allocs++;
+  return malloc(sz);
+}
+
+void*
+wtf_calloc(size_t n, size_t sz)
+{
+  stat_add(allocs, 1);
+  thread_allocs++;
+  return calloc(n, sz);
+}
+
+void*
+wtf_realloc(void *ptr, size_t sz)
+{
+  stat_add(allocs, 1);
+  thread_allocs++;
+  return realloc(ptr, sz);
+}
+
+void
+wtf_free(void *ptr)
+{
+  if (ptr) stat_add(frees, 1);
+  free(ptr);
+}
+
+static double
+now_secs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define cvector_clib_malloc  wtf_malloc
+#define cvector_clib_calloc  wtf_calloc
+#define cvector_clib_realloc wtf_realloc
+#define cvector_clib_free    wtf_free
+
+#include "cvector.h"
+
+/*
+ * Bump allocator.
+ *
+ * Memory is handed out from big blocks and only given back all at once,
+ * either by `arena_reset` (blocks are kept and reused) or `arena_free`.
+ */
+#define ARENA_ALIGN sizeof(max_align_t)
+
+typedef struct wtf_arena_block
+{
+  struct wtf_arena_block *next;
+  size_t cap;
+  size_t used;
+  max_align_t data[];
+}
+wtf_arena_block_t;
+
+typedef struct
+{
+  wtf_arena_block_t *head;
+  wtf_arena_block_t *tail;
+  wtf_arena_block_t *cur;
+  size_t block_sz;
+  size_t reserved; /* Sum of all block capacities. */
+}
+wtf_arena_t;
+
+#define arena_init(sz) ((wtf_arena_t){ .block_sz = (sz) })
+
+static void*
+arena_alloc(wtf_arena_t *arena, size_t sz)
+{
+  sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  /* Blocks past `cur` are left over from before the last reset. */
+  wtf_arena_block_t *b = arena->cur;
+  while (b && b->used + sz > b->cap)
+  {
+    b = b->next;
+    if (b) b->used = 0;
+  }
+
+  if (!b)
+  {
+    size_t cap = sz > arena->block_sz ? sz : arena->block_sz;
+
+    b = wtf_malloc(sizeof(wtf_arena_block_t) + cap);
+    if (!b) return NULL;
+
+    b->next = NULL;
+    b->cap = cap;
+    b->used = 0;
+
+    if (arena->tail) arena->tail->next = b;
+    else arena->head = b;
+    arena->tail = b;
+    arena->reserved += cap;
+  }
+
+  arena->cur = b;
+
+  void *ptr = (char*)b->data + b->used;
+  b->used += sz;
+  return ptr;
+}
+
+/* Forget everything allocated so far, but keep the blocks around. */
+static void
+arena_reset(wtf_arena_t *arena)
+{
+  arena->cur = arena->head;
+  if (arena->head) arena->head->used = 0;
+}
+
+static void
+arena_free(wtf_arena_t *arena)
+{
+  wtf_arena_block_t *b = arena->head;
+  while (b)
+  {
+    wtf_arena_block_t *next = b->next;
+    wtf_free(b);
+    b = next;
+  }
+
+  *arena = arena_init(arena->block_sz);
+}
+
+static wtf_entry_t
+wtf_entry_new(const char *label, size_t lsz)
+{
+  return (wtf_entry_t){
+    .label = label,
+    .label_sz = lsz,
+  };
+}
+
+/*
+ * Case folding. wtf never switches away from the C locale, where `towlower` only
+ * touches ASCII letters, so that's all that is folded here, without a call per byte.
+ */
+#define fold(c) ((unsigned char)((c) - 'A') < 26 ? ((c) | 0x20) : (c))
+
+static int
+minimum(int x, int y)
+{
+  return x < y ? x : y;
+}
+
+static int
+minimum3(int x, int y, int z)
+{
+  return x < y ? minimum(x, z) : minimum(y, z);
+}
+
+/*
+ * Levenshtein distance.
+ * Implemented from Wikipedia.org: https://en.wikipedia.org/wiki/Levenshtein_distance
+ *
+ * Only a single row of the matrix is kept, so `row` must hold `bsz + 1` ints.
+ * `b` is expected to be the (short) query.
+ */
+static int
+ldistance(const char *a, size_t asz, const char *b, size_t bsz, int *row)
+{
+  for (size_t j = 0; j <= bsz; j++) row[j] = j;
+
+  for (size_t i = 0; i < asz; i++)
+  {
+    int diag = row[0];
+    row[0] = i + 1;
+
+    for (size_t j = 0; j < bsz; j++)
+    {
+      int up = row[j+1];
+      int cost = (a[i] == b[j]) ? 0 : 1;
+
+      row[j+1] = minimum3(
+        up + 1,
+        row[j] + 1,
+        diag + cost
+      );
+      diag = up;
+    }
+  }
+
+  return row[bsz];
+}
+
+/* Strips the leading `'` of an exact query. Returns whether there was one. */
+static inline bool
+exact_query(const char **pat, size_t *pat_sz)
+{
+  if (*pat_sz == 0 || **pat != '\'') return false;
+
+  (*pat)++;
+  (*pat_sz)--;
+  return true;
+}
+
+/*
+ * Where `pat` first occurs in `s`, case-insensitively, or -1. With `folded`,
+ * `s` and `pat` are already case-folded.
+ */
+static ssize_t
+find_folded(const char *s, size_t sz, bool folded, const char *pat, size_t pat_sz)
+{
+  if (folded)
+  {
+    const char *at = memmem(s, sz, pat, pat_sz);
+    return at ? at - s : -1;
+  }
+
+  for (size_t i = 0; i + pat_sz <= sz; i++)
+  {
+    size_t j = 0;
+    while (j < pat_sz && fold(s[i + j]) == fold(pat[j])) j++;
+    if (j == pat_sz) return i;
+  }
+
+  return -1;
+}
+
+ssize_t
+wtf_mark_next(const wtf_entry_t *entry, const char *pat, size_t pat_sz, size_t *i, size_t *j)
+{
+  /* The characters of an exact query are the ones of its first occurrence. */
+  if (exact_query(&pat, &pat_sz) && *j == 0 && pat_sz)
+  {
+    ssize_t at = find_folded(entry->label + *i, entry->label_sz - *i, false, pat, pat_sz);
+    if (at < 0) return -1;
+    *i += at;
+  }
+
+  for (; *i < entry->label_sz && *j < pat_sz; (*i)++)
+  {
+    if (fold(entry->label[*i]) == fold(pat[*j]))
+    {
+      (*j)++;
+      return (*i)++;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Does what a full `wtf_mark_next` walk does, against the folded pattern `fpat`.
+ * Returns the number of matched pattern characters, and stores the position of the first
+ * one in `first` (-1 if none). With `folded`, `label` is already case-folded.
+ */
+static inline size_t
+wtf_entry_mark(const char *label, size_t label_sz, bool folded, const char *fpat, size_t pat_sz, ssize_t *first)
+{
+  size_t j = 0; /* Index in pattern. */
+
+  *first = -1;
+  for (size_t i = 0; i < label_sz && j < pat_sz; i++)
+  {
+    char c = folded ? label[i] : fold(label[i]);
+    if (c != fpat[j]) continue;
+
+    if (j == 0) *first = i;
+    j++;
+  }
+
+  return j;
+}
+
+/*
+ * The edit distance between two strings is at least the difference of their lengths,
+ * which is all `ldistance` needs to be skipped for entries that can't make the cut.
+ */
+#define length_gap(a, b) ((a) > (b) ? (a) - (b) : (b) - (a))
+
+/*
+ * TODO: Document/explain this algorithm.
+ *
+ * `fpat` is the case-folded pattern, `flabel` the folded label if there is one at hand
+ * (NULL otherwise). `row` is scratch space for `ldistance`. If the distance can't be
+ * `cutoff` or less, it's left at INT_MAX instead of being computed.
+ */
+static void
+wtf_entry_rate(const wtf_entry_t *entry, const char *flabel, const char *pat, const char *fpat, size_t pat_sz, int *row, int cutoff, wtf_match_t *match)
+{
+  ssize_t most_distant_marker;
+  size_t j = flabel
+    ? wtf_entry_mark(flabel, entry->label_sz, true, fpat, pat_sz, &most_distant_marker)
+    : wtf_entry_mark(entry->label, entry->label_sz, false, fpat, pat_sz, &most_distant_marker);
+
+  match->entry = entry;
+  match->inaccuracy = 2 * (pat_sz - j);
+
+  int rest = most_distant_marker + match->inaccuracy;
+  if ((long long)length_gap(entry->label_sz, pat_sz) + rest > cutoff)
+  {
+    match->distance = INT_MAX;
+    return;
+  }
+
+  match->distance = ldistance(
+    entry->label, entry->label_sz,
+    pat, pat_sz,
+    row
+  ) + rest;
+}
+
+/*
+ * Rates an entry against an exact query: the label must hold it as a substring.
+ * Scored like a fuzzy match missing nothing, from where the substring starts.
+ * Returns whether it matches; `cutoff` as for `wtf_entry_rate`.
+ */
+static bool
+wtf_entry_rate_exact(const wtf_entry_t *entry, const char *flabel, const char *pat, const char *fpat, size_t pat_sz, int *row, int cutoff, wtf_match_t *match)
+{
+  ssize_t at = flabel
+    ? find_folded(flabel, entry->label_sz, true, fpat, pat_sz)
+    : find_folded(entry->label, entry->label_sz, false, fpat, pat_sz);
+  if (at < 0) return false;
+
+  match->entry = entry;
+  match->inaccuracy = 0;
+
+  if ((long long)length_gap(entry->label_sz, pat_sz) + at > cutoff)
+  {
+    match->distance = INT_MAX;
+    return true;
+  }
+
+  match->distance = ldistance(
+    entry->label, entry->label_sz,
+    pat, pat_sz,
+    row
+  ) + at;
+  return true;
+}
+
+int
+wtf_match_cmp(const wtf_match_t *a, const wtf_match_t *b)
+{
+  if (a->distance != b->distance) return a->distance - b->distance;
+  return (a->entry > b->entry) - (a->entry < b->entry);
+}
+
+/* Restores the max-heap property (worst match on top) below `i`. */
+static void
+heap_sift_down(wtf_match_t *heap, size_t n, size_t i)
+{
+  for (;;)
+  {
+    size_t worst = i;
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+
+    if (l < n && wtf_match_cmp(&heap[l], &heap[worst]) > 0) worst = l;
+    if (r < n && wtf_match_cmp(&heap[r], &heap[worst]) > 0) worst = r;
+    if (worst == i) return;
+
+    wtf_match_t tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+/*
+ * Character signatures: one bit per folded character class present in a label.
+ * Letters and digits get a bit each, every other byte shares one of the rest.
+ *
+ * Every query character whose bit an entry lacks is missing from it, so entries
+ * can be ruled out before anything gets scored.
+ */
+static inline int
+signature_bit(char c)
+{
+  unsigned char u = fold(c);
+
+  if (u >= 'a' && u <= 'z') return u - 'a';
+  if (u >= '0' && u <= '9') return 26 + (u - '0');
+  return 36 + u % 28;
+}
+
+static uint64_t
+signature(const char *s, size_t sz)
+{
+  uint64_t sig = 0;
+  for (size_t i = 0; i < sz; i++) sig |= (uint64_t)1 << signature_bit(s[i]);
+  return sig;
+}
+
+/*
+ * The parts of an index file (see INDEX FILES) a scoring pass can use.
+ * They cover the first `count` entries of the corpus.
+ */
+typedef struct
+{
+  void *map;
+  size_t map_sz;
+  size_t count;
+  const char *text;      /* Labels, each followed by a NUL. Entries point in here. */
+  const char *folded;    /* The same, case-folded. */
+  const uint64_t *offsets;
+  const uint32_t *lengths;
+  const uint64_t *signatures;
+}
+wtf_index_t;
+
+/*
+ * CHARACTER POSTINGS
+ *
+ * For every folded byte value, the ids of the entries holding it, as a roaring-style
+ * bitmap: ids are split into chunks of 65536, and each chunk keeps either a sorted
+ * array of the low 16 bits (sparse) or a plain 8 KiB bitmap (dense).
+ *
+ * A query's candidates are the entries holding every one of its characters, found by
+ * intersecting its characters' postings, rarest first. Only they need to be scored.
+ */
+#define POSTING_CHUNK_BITS 16
+#define POSTING_CHUNK_SZ ((size_t)1 << POSTING_CHUNK_BITS)
+#define POSTING_ARRAY_MAX 4096 /* Past this, a bitmap is smaller than an array. */
+
+typedef struct
+{
+  uint32_t card; /* Entries of the chunk holding the character. */
+  union
+  {
+    uint16_t *array;  /* If `card <= POSTING_ARRAY_MAX`. */
+    uint64_t *bitmap; /* Otherwise. */
+  };
+}
+wtf_container_t;
+
+typedef struct
+{
+  size_t count;   /* Entries covered, the first ones of the corpus. */
+  size_t nchunks;
+  size_t card[256];
+  wtf_container_t *chars[256]; /* `nchunks` containers each, NULL for bytes never seen. */
+  wtf_arena_t arena;           /* All of the above lives here. */
+}
+wtf_postings_t;
+
+static void
+postings_free(wtf_postings_t *postings)
+{
+  if (!postings) return;
+
+  arena_free(&postings->arena);
+  wtf_free(postings);
+}
+
+/* Chunk by chunk: collect the ids per byte value, then settle on a container for each. */
+static wtf_postings_t*
+postings_build(const wtf_entry_t *entries, size_t count)
+{
+  wtf_postings_t *postings = wtf_calloc(1, sizeof(wtf_postings_t));
+  uint16_t *ids[256] = {0};
+  size_t last[256] = {0}; /* Last entry (plus one) each byte was seen in. */
+  uint32_t fill[256];
+
+  if (!postings) return NULL;
+
+  postings->arena = arena_init(1 << 20);
+  postings->count = count;
+  postings->nchunks = (count + POSTING_CHUNK_SZ - 1) >> POSTING_CHUNK_BITS;
+
+  for (size_t k = 0; k < postings->nchunks; k++)
+  {
+    size_t lo = k << POSTING_CHUNK_BITS;
+    size_t hi = lo + POSTING_CHUNK_SZ < count ? lo + POSTING_CHUNK_SZ : count;
+
+    memset(fill, 0, sizeof(fill));
+
+    for (size_t i = lo; i < hi; i++)
+    {
+      const char *label = entries[i].label;
+      for (size_t j = 0; j < entries[i].label_sz; j++)
+      {
+        unsigned char c = fold(label[j]);
+        if (last[c] == i + 1) continue;
+        last[c] = i + 1;
+
+        if (!ids[c] && !(ids[c] = wtf_malloc(POSTING_CHUNK_SZ * sizeof(uint16_t))))
+          goto postings_build_fail;
+        ids[c][fill[c]++] = i - lo;
+      }
+    }
+
+    for (int c = 0; c < 256; c++)
+    {
+      if (!fill[c]) continue;
+
+      if (!postings->chars[c])
+      {
+        postings->chars[c] = arena_alloc(&postings->arena, postings->nchunks * sizeof(wtf_container_t));
+        if (!postings->chars[c]) goto postings_build_fail;
+        memset(postings->chars[c], 0, postings->nchunks * sizeof(wtf_container_t));
+      }
+
+      wtf_container_t *ct = &postings->chars[c][k];
+      ct->card = fill[c];
+      postings->card[c] += fill[c];
+
+      if (fill[c] <= POSTING_ARRAY_MAX)
+      {
+        ct->array = arena_alloc(&postings->arena, fill[c] * sizeof(uint16_t));
+        if (!ct->array) goto postings_build_fail;
+        memcpy(ct->array, ids[c], fill[c] * sizeof(uint16_t));
+      }
+      else
+      {
+        ct->bitmap = arena_alloc(&postings->arena, POSTING_CHUNK_SZ / 8);
+        if (!ct->bitmap) goto postings_build_fail;
+        memset(ct->bitmap, 0, POSTING_CHUNK_SZ / 8);
+        for (uint32_t x = 0; x < fill[c]; x++)
+          ct->bitmap[ids[c][x] >> 6] |= (uint64_t)1 << (ids[c][x] & 63);
+      }
+    }
+  }
+
+  for (int c = 0; c < 256; c++) wtf_free(ids[c]);
+  return postings;
+
+postings_build_fail:
+  for (int c = 0; c < 256; c++) wtf_free(ids[c]);
+  postings_free(postings);
+  return NULL;
+}
+
+/*
+ * Picks the distinct folded bytes of the query, rarest first, into `chars`.
+ * Returns how many there are, or 0 if one of them appears nowhere at all.
+ */
+static size_t
+postings_query(const wtf_postings_t *postings, const char *fquery, size_t query_sz, unsigned char *chars)
+{
+  bool seen[256] = {0};
+  size_t n = 0;
+
+  for (size_t i = 0; i < query_sz; i++)
+  {
+    unsigned char c = fquery[i];
+    if (seen[c]) continue;
+    seen[c] = true;
+
+    if (!postings->card[c]) return 0;
+
+    size_t j = n++;
+    for (; j > 0 && postings->card[chars[j - 1]] > postings->card[c]; j--) chars[j] = chars[j - 1];
+    chars[j] = c;
+  }
+
+  return n;
+}
+
+/* Keeps the ids in `out` that are also in the sorted `array`. */
+static size_t
+array_intersect(const uint16_t *array, size_t card, uint16_t *out, size_t n)
+{
+  size_t m = 0;
+
+  /* `out` is usually the much shorter one, so gallop through `array`. */
+  size_t y = 0;
+  for (size_t x = 0; x < n && y < card; x++)
+  {
+    size_t step = 1;
+    while (y + step < card && array[y + step] < out[x]) step *= 2;
+
+    size_t lo = y;
+    size_t hi = y + step < card ? y + step : card - 1;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (array[mid] < out[x]) lo = mid + 1;
+      else hi = mid;
+    }
+
+    y = lo;
+    if (array[y] == out[x]) out[m++] = out[x];
+  }
+
+  return m;
+}
+
+/* Keeps the ids in `out` that are also in `ct`. Both are sorted. */
+static size_t
+container_intersect(const wtf_container_t *ct, uint16_t *out, size_t n)
+{
+  if (ct->card <= POSTING_ARRAY_MAX) return array_intersect(ct->array, ct->card, out, n);
+
+  size_t m = 0;
+  for (size_t x = 0; x < n; x++)
+    if (ct->bitmap[out[x] >> 6] & ((uint64_t)1 << (out[x] & 63))) out[m++] = out[x];
+  return m;
+}
+
+/*
+ * Fills `out` with the low bits of the ids in chunk `k` holding every one of `chars`,
+ * in ascending order, and returns how many there are.
+ */
+static size_t
+postings_chunk(const wtf_postings_t *postings, size_t k, const unsigned char *chars, size_t nchars, uint16_t *out)
+{
+  for (size_t c = 0; c < nchars; c++)
+    if (!postings->chars[chars[c]][k].card) return 0;
+
+  const wtf_container_t *first = &postings->chars[chars[0]][k];
+  size_t n = 0;
+
+  if (first->card <= POSTING_ARRAY_MAX)
+  {
+    memcpy(out, first->array, first->card * sizeof(uint16_t));
+    n = first->card;
+  }
+  else
+  {
+    for (size_t w = 0; w < POSTING_CHUNK_SZ / 64; w++)
+      for (uint64_t bits = first->bitmap[w]; bits; bits &= bits - 1)
+        out[n++] = w * 64 + __builtin_ctzll(bits);
+  }
+
+  for (size_t c = 1; c < nchars && n; c++)
+    n = container_intersect(&postings->chars[chars[c]][k], out, n);
+
+  return n;
+}
+
+/*
+ * TRIGRAMS
+ *
+ * For every folded trigram (three bytes in a row), the ids of the entries holding it.
+ * Ids are split into chunks of 65536 as for the character postings. Each chunk has a
+ * sorted table of the trigrams seen in it, each pointing at a sorted run of the low
+ * 16 bits of its ids.
+ *
+ * A label holding a substring holds every trigram of it, so the candidates for an
+ * exact query are the intersection of its trigrams' runs. They still get verified
+ * when rated. Index files store the same arrays, so a loaded index is used in place.
+ */
+typedef struct
+{
+  uint64_t keys;  /* First row of the chunk in `keys`. */
+  uint64_t nkeys;
+}
+wtf_trigram_chunk_t;
+
+typedef struct
+{
+  size_t count;   /* Entries covered, the first ones of the corpus. */
+  size_t nchunks;
+  size_t nkeys;
+  size_t nids;
+  const wtf_trigram_chunk_t *chunks;
+  const uint32_t *keys;   /* Trigrams, sorted within each chunk. */
+  const uint64_t *starts; /* Where the run of each key starts in `ids`, plus its end. */
+  const uint16_t *ids;
+
+  /* What the above point to, unless it's mapped from an index file. */
+  cvector(wtf_trigram_chunk_t) own_chunks;
+  cvector(uint32_t) own_keys;
+  cvector(uint64_t) own_starts;
+  cvector(uint16_t) own_ids;
+}
+wtf_trigrams_t;
+
+#define trigram_next(t, c) ((((t) << 8) | (unsigned char)fold(c)) & 0xffffff)
+
+static size_t
+trigrams_bytes(const wtf_trigrams_t *t)
+{
+  return t->nchunks * sizeof(wtf_trigram_chunk_t) + t->nkeys * sizeof(uint32_t)
+    + (t->nkeys + 1) * sizeof(uint64_t) + t->nids * sizeof(uint16_t);
+}
+
+static void
+trigrams_free(wtf_trigrams_t *t)
+{
+  if (!t) return;
+
+  cvector_free(t->own_chunks);
+  cvector_free(t->own_keys);
+  cvector_free(t->own_starts);
+  cvector_free(t->own_ids);
+  wtf_free(t);
+}
+
+/*
+ * Stable counting sort of `n` (trigram << 16 | id) pairs on their trigram, 16 bits
+ * at a time. The pairs come in id order, so that's all the sorting they need.
+ */
+static uint64_t*
+trigram_pairs_sort(uint64_t *pairs, uint64_t *tmp, size_t n, size_t *hist)
+{
+  for (int shift = 16; shift < 40; shift += 16)
+  {
+    memset(hist, 0, (1 << 16) * sizeof(size_t));
+    for (size_t x = 0; x < n; x++) hist[(pairs[x] >> shift) & 0xffff]++;
+
+    for (size_t d = 0, sum = 0; d < (1 << 16); d++)
+    {
+      size_t c = hist[d];
+      hist[d] = sum;
+      sum += c;
+    }
+
+    for (size_t x = 0; x < n; x++) tmp[hist[(pairs[x] >> shift) & 0xffff]++] = pairs[x];
+
+    uint64_t *swap = pairs;
+    pairs = tmp;
+    tmp = swap;
+  }
+
+  return pairs;
+}
+
+/* Chunk by chunk: collect every (trigram, id) pair, sort them and lay them out as runs. */
+static wtf_trigrams_t*
+trigrams_build(const wtf_entry_t *entries, size_t count)
+{
+  wtf_trigrams_t *t = wtf_calloc(1, sizeof(wtf_trigrams_t));
+  cvector(uint64_t) pairs = NULL;
+  cvector(uint64_t) tmp = NULL;
+  size_t *hist = wtf_malloc((1 << 16) * sizeof(size_t));
+
+  if (!t || !hist) goto trigrams_build_fail;
+
+  t->count = count;
+  t->nchunks = (count + POSTING_CHUNK_SZ - 1) >> POSTING_CHUNK_BITS;
+  cvector_reserve(t->own_chunks, t->nchunks ? t->nchunks : 1);
+  if (!t->own_chunks) goto trigrams_build_fail;
+
+  for (size_t k = 0; k < t->nchunks; k++)
+  {
+    size_t lo = k << POSTING_CHUNK_BITS;
+    size_t hi = lo + POSTING_CHUNK_SZ < count ? lo + POSTING_CHUNK_SZ : count;
+
+    cvector_clear(pairs);
+    for (size_t i = lo; i < hi; i++)
+    {
+      const char *label = entries[i].label;
+      size_t sz = entries[i].label_sz;
+      if (sz < 3) continue;
+
+      uint32_t tri = trigram_next(trigram_next(0, label[0]), label[1]);
+      for (size_t j = 2; j < sz; j++)
+      {
+        tri = trigram_next(tri, label[j]);
+        cvector_push_back(pairs, (uint64_t)tri << 16 | (i - lo));
+      }
+    }
+
+    size_t n = cvector_size(pairs);
+    wtf_trigram_chunk_t chunk = { .keys = cvector_size(t->own_keys) };
+
+    if (n)
+    {
+      cvector_reserve(tmp, n);
+      if (!pairs || !tmp) goto trigrams_build_fail;
+
+      uint64_t *sorted = trigram_pairs_sort(pairs, tmp, n, hist);
+      uint64_t prev = UINT64_MAX;
+
+      for (size_t x = 0; x < n; x++)
+      {
+        /* A label holding a trigram more than once. */
+        if (sorted[x] == prev) continue;
+
+        uint32_t key = sorted[x] >> 16;
+        if (prev == UINT64_MAX || key != prev >> 16)
+        {
+          cvector_push_back(t->own_keys, key);
+          cvector_push_back(t->own_starts, cvector_size(t->own_ids));
+        }
+        cvector_push_back(t->own_ids, sorted[x] & 0xffff);
+        prev = sorted[x];
+      }
+    }
+
+    chunk.nkeys = cvector_size(t->own_keys) - chunk.keys;
+    cvector_push_back(t->own_chunks, chunk);
+  }
+
+  cvector_push_back(t->own_starts, cvector_size(t->own_ids));
+  if (!t->own_starts) goto trigrams_build_fail;
+
+  t->chunks = t->own_chunks;
+  t->keys = t->own_keys;
+  t->starts = t->own_starts;
+  t->ids = t->own_ids;
+  t->nkeys = cvector_size(t->own_keys);
+  t->nids = cvector_size(t->own_ids);
+
+  cvector_free(pairs);
+  cvector_free(tmp);
+  wtf_free(hist);
+  return t;
+
+trigrams_build_fail:
+  cvector_free(pairs);
+  cvector_free(tmp);
+  wtf_free(hist);
+  trigrams_free(t);
+  return NULL;
+}
+
+/* Puts the distinct trigrams of the folded query in `grams`. Returns how many there are. */
+static size_t
+trigrams_query(const char *fquery, size_t query_sz, uint32_t *grams)
+{
+  size_t n = 0;
+  uint32_t tri = trigram_next(trigram_next(0, fquery[0]), fquery[1]);
+
+  for (size_t i = 2; i < query_sz; i++)
+  {
+    tri = trigram_next(tri, fquery[i]);
+
+    size_t g = 0;
+    while (g < n && grams[g] != tri) g++;
+    if (g == n) grams[n++] = tri;
+  }
+
+  return n;
+}
+
+/*
+ * Fills `out` with the low bits of the ids in chunk `k` holding every one of `grams`,
+ * in ascending order, and returns how many there are. `runs` and `lens` are scratch
+ * space for `ngrams` each.
+ */
+static size_t
+trigrams_chunk(const wtf_trigrams_t *t, size_t k, const uint32_t *grams, size_t ngrams, const uint16_t **runs, size_t *lens, uint16_t *out)
+{
+  const uint32_t *keys = t->keys + t->chunks[k].keys;
+  size_t nkeys = t->chunks[k].nkeys;
+
+  for (size_t g = 0; g < ngrams; g++)
+  {
+    size_t lo = 0, hi = nkeys;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (keys[mid] < grams[g]) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo == nkeys || keys[lo] != grams[g]) return 0;
+
+    /* Shortest run first. */
+    size_t row = t->chunks[k].keys + lo;
+    size_t len = t->starts[row + 1] - t->starts[row];
+    size_t j = g;
+    for (; j > 0 && lens[j - 1] > len; j--)
+    {
+      runs[j] = runs[j - 1];
+      lens[j] = lens[j - 1];
+    }
+    runs[j] = t->ids + t->starts[row];
+    lens[j] = len;
+  }
+
+  memcpy(out, runs[0], lens[0] * sizeof(uint16_t));
+  size_t n = lens[0];
+
+  for (size_t g = 1; g < ngrams && n; g++) n = array_intersect(runs[g], lens[g], out, n);
+  return n;
+}
+
+/*
+ * LENGTH BUCKETS
+ *
+ * Entry ids grouped by label length: one bucket per length up to 31, then one per
+ * power of two. As no entry is closer to the query than the difference of their
+ * lengths, a top-K pass visits the buckets closest in length first, which fills the
+ * heap with good matches early, and can stop once no bucket left could beat the
+ * worst of them.
+ */
+#define LENGTH_BUCKETS 64
+#define LENGTH_EXACT 32 /* Lengths with a bucket of their own. */
+
+typedef struct
+{
+  size_t count; /* Entries bucketed, the first ones of the corpus. */
+  cvector(uint32_t) ids[LENGTH_BUCKETS];
+}
+wtf_buckets_t;
+
+static int
+length_bucket(size_t len)
+{
+  if (len < LENGTH_EXACT) return len;
+
+  int b = LENGTH_EXACT + (63 - __builtin_clzll(len)) - __builtin_ctz(LENGTH_EXACT);
+  return b < LENGTH_BUCKETS ? b : LENGTH_BUCKETS - 1;
+}
+
+/* The smallest length difference between the query and a label in bucket `b`. */
+static size_t
+bucket_gap(int b, size_t query_sz)
+{
+  if (b < LENGTH_EXACT) return length_gap((size_t)b, query_sz);
+
+  size_t lo = (size_t)1 << (b - LENGTH_EXACT + __builtin_ctz(LENGTH_EXACT));
+  size_t hi = b == LENGTH_BUCKETS - 1 ? SIZE_MAX : 2 * lo - 1;
+
+  if (query_sz < lo) return lo - query_sz;
+  if (query_sz > hi) return query_sz - hi;
+  return 0;
+}
+
+/* Buckets whatever entries were added since last time. Ids are 32 bits, so past that, nothing is. */
+static void
+buckets_add(wtf_buckets_t *buckets, const wtf_entry_t *entries, size_t count)
+{
+  if (count > UINT32_MAX) return;
+
+  for (size_t i = buckets->count; i < count; i++)
+    cvector_push_back(buckets->ids[length_bucket(entries[i].label_sz)], i);
+  buckets->count = count;
+}
+
+static void
+buckets_free(wtf_buckets_t *buckets)
+{
+  for (int b = 0; b < LENGTH_BUCKETS; b++) cvector_free(buckets->ids[b]);
+}
+
+/*
+ * QUERY CONTEXT
+ *
+ * The scratch arena is reset at the start of each scoring pass, so a pass never
+ * touches the heap once the arena has grown big enough.
+ */
+struct wtf_ctx
+{
+  wtf_arena_t scratch;
+  int max_inaccuracy;
+
+  wtf_progress_fn progress; /* See `wtf_ctx_set_progress`. */
+  void *progress_arg;
+  double progress_secs;
+};
+
+wtf_ctx_t*
+wtf_ctx_new(int max_inaccuracy)
+{
+  wtf_ctx_t *ctx = wtf_malloc(sizeof(wtf_ctx_t));
+  if (!ctx) return NULL;
+
+  *ctx = (wtf_ctx_t){ .scratch = arena_init(4096), .max_inaccuracy = max_inaccuracy };
+  return ctx;
+}
+
+void
+wtf_ctx_set_progress(wtf_ctx_t *ctx, wtf_progress_fn fn, void *arg, double interval_secs)
+{
+  ctx->progress = fn;
+  ctx->progress_arg = arg;
+  ctx->progress_secs = interval_secs;
+}
+
+void
+wtf_ctx_free(wtf_ctx_t *ctx)
+{
+  if (!ctx) return;
+
+  stat_add(scratch_bytes, ctx->scratch.reserved);
+  arena_free(&ctx->scratch);
+  wtf_free(ctx);
+}
+
+/* Resets the scratch arena and makes room for a pass: the DP row and the folded query. */
+static bool
+ctx_prepare(wtf_ctx_t *ctx, const char *query, size_t query_sz, int **row, char **fquery)
+{
+  arena_reset(&ctx->scratch);
+  *row = arena_alloc(&ctx->scratch, (query_sz + 1) * sizeof(int));
+  *fquery = arena_alloc(&ctx->scratch, query_sz + 1);
+  if (!*row || !*fquery) return false;
+
+  for (size_t i = 0; i < query_sz; i++) (*fquery)[i] = fold(query[i]);
+  return true;
+}
+
+bool
+wtf_rate(wtf_ctx_t *ctx, const wtf_entry_t *entry, const char *query, size_t query_sz, wtf_match_t *match)
+{
+  bool exact = exact_query(&query, &query_sz) && query_sz;
+  int *row;
+  char *fquery;
+  if (!ctx_prepare(ctx, query, query_sz, &row, &fquery)) return false;
+
+  if (exact) return wtf_entry_rate_exact(entry, NULL, query, fquery, query_sz, row, INT_MAX, match);
+
+  wtf_entry_rate(entry, NULL, query, fquery, query_sz, row, INT_MAX, match);
+  return match->inaccuracy <= ctx->max_inaccuracy;
+}
+
+/* State of one scoring pass. */
+typedef struct
+{
+  const wtf_entry_t *entries;
+  const wtf_index_t *index;
+  const char *query;
+  const char *fquery; /* Case-folded. */
+  size_t query_sz;
+  uint64_t qsig;
+  bool exact;
+  int max_inaccuracy; /* 0 for exact queries. */
+  int *row;
+
+  wtf_match_t *ranked;
+  size_t limit;
+  size_t n;           /* Matches in `ranked`. */
+  size_t passed;      /* Matches in all. */
+  size_t sig_skips;
+  size_t length_skips;
+
+  const wtf_ctx_t *ctx;
+  size_t count;     /* Entries the pass goes through. */
+  double next_tick; /* When progress is due next. */
+  bool abandoned;
+}
+wtf_pass_t;
+
+/* How many entries a scan goes through between looking at the clock. */
+#define TICK_ENTRIES 4096
+
+/*
+ * Reports progress, `done` entries in, if it's due. Returns false once the pass
+ * is to be abandoned.
+ */
+static bool
+pass_tick(wtf_pass_t *p, size_t done)
+{
+  if (!p->ctx->progress) return true;
+
+  double now = now_secs();
+  if (now < p->next_tick) return true;
+  p->next_tick = now + p->ctx->progress_secs;
+
+  p->abandoned = !p->ctx->progress(p->ctx->progress_arg, p->ranked, p->n, p->passed, done, p->count);
+  return !p->abandoned;
+}
+
+/*
+ * Rates entry `i` and keeps it if it's good enough. With a `limit`, a bounded max-heap
+ * keeps the best `limit` matches seen so far, so only those few get sorted in the end.
+ */
+static inline void
+pass_consider(wtf_pass_t *p, size_t i)
+{
+  wtf_match_t match;
+  const char *flabel = NULL;
+  int cutoff = p->limit && p->n == p->limit ? p->ranked[0].distance : INT_MAX;
+
+  if (p->index && i < p->index->count)
+  {
+    /* Each missing signature bit is at least one missing query character. */
+    if (2 * __builtin_popcountll(p->qsig & ~p->index->signatures[i]) > p->max_inaccuracy)
+    {
+      p->sig_skips++;
+      return;
+    }
+    flabel = p->index->folded + p->index->offsets[i];
+  }
+
+  if (p->exact)
+  {
+    if (!wtf_entry_rate_exact(&p->entries[i], flabel, p->query, p->fquery, p->query_sz, p->row, cutoff, &match)) return;
+  }
+  else
+  {
+    wtf_entry_rate(&p->entries[i], flabel, p->query, p->fquery, p->query_sz, p->row, cutoff, &match);
+    if (match.inaccuracy > p->max_inaccuracy) return;
+  }
+  p->passed++;
+
+  if (match.distance == INT_MAX)
+  {
+    p->length_skips++;
+    return;
+  }
+
+  if (!p->limit || p->n < p->limit)
+  {
+    p->ranked[p->n++] = match;
+    if (p->limit && p->n == p->limit)
+      for (size_t j = p->n / 2; j-- > 0;) heap_sift_down(p->ranked, p->n, j);
+  }
+  else if (wtf_match_cmp(&match, &p->ranked[0]) < 0)
+  {
+    p->ranked[0] = match;
+    heap_sift_down(p->ranked, p->n, 0);
+  }
+}
+
+/*
+ * Everything `wtf_rank` and `wtf_corpus_rank` promise. With an `index`, its entries
+ * are first checked against the query signature and rated on their folded text.
+ * With `trigrams`, exact queries of at least three characters only consider the
+ * entries holding all of their trigrams. Otherwise, with `postings` and no missing
+ * characters tolerated, only the entries they leave as candidates are considered.
+ * Everything else is scanned, by length bucket if `buckets` cover it all.
+ */
+static size_t
+rank_entries(wtf_ctx_t *ctx, const wtf_entry_t *entries, size_t count, const wtf_index_t *index, const wtf_postings_t *postings, const wtf_trigrams_t *trigrams, const wtf_buckets_t *buckets, const char *query, size_t query_sz, size_t limit, wtf_match_t *ranked, size_t *matched)
+{
+  bool exact = exact_query(&query, &query_sz);
+
+  if (query_sz == 0)
+  {
+    size_t n = (limit && limit < count) ? limit : count;
+    for (size_t i = 0; i < n; i++)
+      ranked[i] = (wtf_match_t){ .entry = &entries[i] };
+
+    if (matched) *matched = count;
+    return n;
+  }
+
+  int *row;
+  char *fquery;
+  if (!ctx_prepare(ctx, query, query_sz, &row, &fquery)) return 0;
+
+  wtf_pass_t p = {
+    .entries = entries,
+    .index = index,
+    .query = query,
+    .fquery = fquery,
+    .query_sz = query_sz,
+    .qsig = signature(query, query_sz),
+    .exact = exact,
+    .max_inaccuracy = exact ? 0 : ctx->max_inaccuracy,
+    .row = row,
+    .ranked = ranked,
+    .limit = limit,
+    .ctx = ctx,
+    .count = count,
+    .next_tick = ctx->progress ? now_secs() + ctx->progress_secs : 0,
+  };
+
+  size_t i = 0;
+
+  if (trigrams && exact && query_sz >= 3)
+  {
+    uint32_t *grams = arena_alloc(&ctx->scratch, query_sz * sizeof(uint32_t));
+    const uint16_t **runs = arena_alloc(&ctx->scratch, query_sz * sizeof(uint16_t*));
+    size_t *lens = arena_alloc(&ctx->scratch, query_sz * sizeof(size_t));
+    uint16_t *ids = arena_alloc(&ctx->scratch, POSTING_CHUNK_SZ * sizeof(uint16_t));
+
+    if (grams && runs && lens && ids)
+    {
+      size_t ngrams = trigrams_query(fquery, query_sz, grams);
+      size_t candidates = 0;
+
+      for (size_t k = 0; k < trigrams->nchunks; k++)
+      {
+        size_t base = k << POSTING_CHUNK_BITS;
+        size_t n = trigrams_chunk(trigrams, k, grams, ngrams, runs, lens, ids);
+
+        for (size_t x = 0; x < n; x++)
+          if (base + ids[x] < trigrams->count) pass_consider(&p, base + ids[x]);
+        candidates += n;
+
+        if (!pass_tick(&p, base + POSTING_CHUNK_SZ < count ? base + POSTING_CHUNK_SZ : count)) break;
+      }
+
+      stat_add(trigram_queries, 1);
+      stat_add(trigram_skips, trigrams->count - candidates);
+      i = trigrams->count;
+    }
+  }
+  else if (postings && p.max_inaccuracy < 2)
+  {
+    unsigned char chars[256];
+    size_t nchars = postings_query(postings, fquery, query_sz, chars);
+    uint16_t *ids = arena_alloc(&ctx->scratch, POSTING_CHUNK_SZ * sizeof(uint16_t));
+
+    if (ids)
+    {
+      size_t candidates = 0;
+
+      for (size_t k = 0; nchars && k < postings->nchunks; k++)
+      {
+        size_t base = k << POSTING_CHUNK_BITS;
+        size_t n = postings_chunk(postings, k, chars, nchars, ids);
+
+        for (size_t x = 0; x < n; x++) pass_consider(&p, base + ids[x]);
+        candidates += n;
+
+        if (!pass_tick(&p, base + POSTING_CHUNK_SZ < count ? base + POSTING_CHUNK_SZ : count)) break;
+      }
+
+      stat_add(postings_skips, postings->count - candidates);
+      i = postings->count;
+    }
+  }
+
+  if (i == 0 && limit && buckets && buckets->count == count)
+  {
+    size_t done = 0;
+    int order[LENGTH_BUCKETS];
+    size_t gaps[LENGTH_BUCKETS];
+
+    /* Closest first. */
+    for (int b = 0; b < LENGTH_BUCKETS; b++)
+    {
+      size_t gap = bucket_gap(b, query_sz);
+      int j = b;
+      for (; j > 0 && gaps[j - 1] > gap; j--)
+      {
+        order[j] = order[j - 1];
+        gaps[j] = gaps[j - 1];
+      }
+      order[j] = b;
+      gaps[j] = gap;
+    }
+
+    for (int o = 0; o < LENGTH_BUCKETS && !p.abandoned; o++)
+    {
+      const uint32_t *ids = buckets->ids[order[o]];
+      size_t n = cvector_size(ids);
+
+      /*
+       * Nothing from here on can make the cut. Unless all matches need counting,
+       * don't even look at them.
+       */
+      if (!matched && p.n == limit && gaps[o] > (size_t)p.ranked[0].distance)
+      {
+        for (; o < LENGTH_BUCKETS; o++) p.length_skips += cvector_size(buckets->ids[order[o]]);
+        break;
+      }
+
+      for (size_t x = 0; x < n; x++)
+      {
+        pass_consider(&p, ids[x]);
+        if (++done % TICK_ENTRIES == 0 && !pass_tick(&p, done)) break;
+      }
+    }
+    i = count;
+  }
+
+  for (; i < count && !p.abandoned; i++)
+  {
+    pass_consider(&p, i);
+    if ((i + 1) % TICK_ENTRIES == 0) pass_tick(&p, i + 1);
+  }
+
+  qsort(
+    ranked,
+    p.n,
+    sizeof(wtf_match_t),
+    (int (*)(const void*, const void*))wtf_match_cmp
+  );
+
+  if (p.sig_skips) stat_add(signature_skips, p.sig_skips);
+  if (p.length_skips) stat_add(length_skips, p.length_skips);
+  if (matched) *matched = p.passed;
+  return p.n;
+}
+
+size_t
+wtf_rank(wtf_ctx_t *ctx, const wtf_entry_t *entries, size_t count, const char *query, size_t query_sz, size_t limit, wtf_match_t *ranked, size_t *matched)
+{
+  return rank_entries(ctx, entries, count, NULL, NULL, NULL, NULL, query, query_sz, limit, ranked, matched);
+}
+
+/*
+ * INPUT
+ *
+ * Input is read into big slabs which are never moved or grown, so entry labels
+ * can point straight into them. When a slab fills up, only the unfinished line
+ * at its end is carried over to the next one.
+ */
+#define SLAB_SZ ((size_t)64 << 20)
+
+typedef struct wtf_slab
+{
+  struct wtf_slab *next;
+  char *data;
+  size_t cap;
+  size_t used;
+}
+wtf_slab_t;
+
+/*
+ * Everything derived from the input: the slabs holding its text, the entries pointing
+ * into them and an arena for the bookkeeping. It's all freed in one go.
+ */
+struct wtf_corpus
+{
+  wtf_arena_t arena;
+  cvector(wtf_entry_t) entries;
+
+  wtf_slab_t *slabs; /* All slabs, newest first. */
+  size_t split;      /* Bytes of the newest slab already turned into entries. */
+  size_t scanned;    /* Bytes of the newest slab already searched for delimiters. */
+  char delim;        /* Byte separating entries. */
+
+  wtf_index_t index; /* Set if the corpus was loaded from an index file. */
+  wtf_postings_t *postings; /* See `wtf_corpus_build_char_index`. */
+  wtf_trigrams_t *trigrams; /* See `wtf_corpus_build_trigram_index`, or from the index file. */
+  wtf_buckets_t buckets;    /* Kept up to date as entries come in. */
+};
+
+/*
+ * Slabs are anonymous mappings, so pages nobody writes to never count towards RSS.
+ * Their headers live in the corpus arena.
+ */
+static wtf_slab_t*
+slab_new(wtf_corpus_t *corpus, size_t cap)
+{
+  char *data = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (data == MAP_FAILED) return NULL;
+
+  wtf_slab_t *slab = arena_alloc(&corpus->arena, sizeof(wtf_slab_t));
+  if (!slab)
+  {
+    munmap(data, cap);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  *slab = (wtf_slab_t){ .data = data, .cap = cap };
+  return slab;
+}
+
+/*
+ * Returns where the next read should go and how much fits there.
+ * One byte of every slab is held back to terminate a final line without a newline.
+ */
+static char*
+corpus_reserve(wtf_corpus_t *corpus, size_t size_hint, size_t *avail)
+{
+  wtf_slab_t *slab = corpus->slabs;
+
+  if (!slab || slab->used + 1 >= slab->cap)
+  {
+    size_t tail = slab ? slab->used - corpus->split : 0;
+    size_t cap = size_hint > SLAB_SZ ? size_hint : SLAB_SZ;
+    if (cap < tail * 2) cap = tail * 2;
+
+    wtf_slab_t *next = slab_new(corpus, cap);
+    if (!next) return NULL;
+
+    if (slab)
+    {
+      memcpy(next->data, slab->data + corpus->split, tail);
+      next->used = tail;
+      slab->used = corpus->split;
+
+      /* Not a single line ended in the old slab, so nothing points into it. */
+      if (corpus->split == 0)
+      {
+        munmap(slab->data, slab->cap);
+        slab = slab->next;
+      }
+    }
+
+    next->next = slab;
+    corpus->slabs = next;
+    corpus->scanned = tail;
+    corpus->split = 0;
+    slab = next;
+  }
+
+  *avail = slab->cap - 1 - slab->used;
+  return slab->data + slab->used;
+}
+
+/*
+ * Accounts for `n` freshly read bytes and turns every completed line into an entry.
+ * Lines end with `corpus->delim`.
+ */
+static void
+corpus_commit(wtf_corpus_t *corpus, size_t n)
+{
+  wtf_slab_t *slab = corpus->slabs;
+  slab->used += n;
+
+  char *line = slab->data + corpus->split;
+  char *scan = slab->data + corpus->scanned;
+  char *end = slab->data + slab->used;
+  char *nl;
+
+  while ((nl = memchr(scan, corpus->delim, end - scan)))
+  {
+    size_t size = nl - line;
+
+    // Null terminate just in case...
+    *nl = '\0';
+
+    if (size > 0) cvector_push_back(corpus->entries, wtf_entry_new(line, size));
+    line = scan = nl + 1;
+  }
+
+  corpus->split = line - slab->data;
+  corpus->scanned = slab->used;
+  buckets_add(&corpus->buckets, corpus->entries, cvector_size(corpus->entries));
+}
+
+/* Turns whatever follows the last delimiter into the final entry. */
+static void
+corpus_finish(wtf_corpus_t *corpus)
+{
+  wtf_slab_t *slab = corpus->slabs;
+  if (!slab || slab->used == corpus->split) return;
+
+  size_t size = slab->used - corpus->split;
+  slab->data[slab->used] = '\0';
+  cvector_push_back(corpus->entries, wtf_entry_new(slab->data + corpus->split, size));
+  buckets_add(&corpus->buckets, corpus->entries, cvector_size(corpus->entries));
+
+  /* Keep the terminator, more input may follow right after it. */
+  slab->used++;
+  corpus->split = corpus->scanned = slab->used;
+}
+
+wtf_corpus_t*
+wtf_corpus_new(char delim)
+{
+  wtf_corpus_t *corpus = wtf_malloc(sizeof(wtf_corpus_t));
+  if (!corpus) return NULL;
+
+  *corpus = (wtf_corpus_t){ .arena = arena_init(1 << 20), .delim = delim };
+  cvector_init(corpus->entries, 64, NULL);
+  return corpus;
+}
+
+void
+wtf_corpus_free(wtf_corpus_t *corpus)
+{
+  if (!corpus) return;
+
+  for (wtf_slab_t *slab = corpus->slabs; slab; slab = slab->next)
+    munmap(slab->data, slab->cap);
+  if (corpus->index.map) munmap(corpus->index.map, corpus->index.map_sz);
+  postings_free(corpus->postings);
+  trigrams_free(corpus->trigrams);
+  buckets_free(&corpus->buckets);
+
+  stat_add(corpus_bytes, corpus->arena.reserved);
+
+  arena_free(&corpus->arena);
+  cvector_free(corpus->entries);
+  wtf_free(corpus);
+}
+
+void
+wtf_corpus_add(wtf_corpus_t *corpus, const char *label, size_t label_sz)
+{
+  cvector_push_back(corpus->entries, wtf_entry_new(label, label_sz));
+  buckets_add(&corpus->buckets, corpus->entries, cvector_size(corpus->entries));
+}
+
+size_t
+wtf_corpus_add_lines(wtf_corpus_t *corpus, const char *buf, size_t sz)
+{
+  size_t before = cvector_size(corpus->entries);
+  const char *end = buf + sz;
+  const char *nl;
+
+  while (buf < end)
+  {
+    nl = memchr(buf, corpus->delim, end - buf);
+    if (!nl) nl = end;
+
+    if (nl > buf) cvector_push_back(corpus->entries, wtf_entry_new(buf, nl - buf));
+    buf = nl + 1;
+  }
+
+  buckets_add(&corpus->buckets, corpus->entries, cvector_size(corpus->entries));
+  return cvector_size(corpus->entries) - before;
+}
+
+const wtf_entry_t*
+wtf_corpus_entries(const wtf_corpus_t *corpus, size_t *n)
+{
+  *n = cvector_size(corpus->entries);
+  return corpus->entries;
+}
+
+bool
+wtf_corpus_build_char_index(wtf_corpus_t *corpus)
+{
+  double start = now_secs();
+  wtf_postings_t *postings = postings_build(corpus->entries, cvector_size(corpus->entries));
+  if (!postings)
+  {
+    errno = ENOMEM;
+    return false;
+  }
+
+  postings_free(corpus->postings);
+  corpus->postings = postings;
+
+  wtf_stats.postings_bytes = postings->arena.reserved;
+  wtf_stats.postings_secs += now_secs() - start;
+  return true;
+}
+
+bool
+wtf_corpus_build_trigram_index(wtf_corpus_t *corpus)
+{
+  size_t count = cvector_size(corpus->entries);
+  if (corpus->trigrams && corpus->trigrams->count == count) return true;
+
+  double start = now_secs();
+  wtf_trigrams_t *trigrams = trigrams_build(corpus->entries, count);
+  if (!trigrams)
+  {
+    errno = ENOMEM;
+    return false;
+  }
+
+  trigrams_free(corpus->trigrams);
+  corpus->trigrams = trigrams;
+
+  wtf_stats.trigram_bytes = trigrams_bytes(trigrams);
+  wtf_stats.trigram_secs += now_secs() - start;
+  return true;
+}
+
+size_t
+wtf_corpus_rank(wtf_ctx_t *ctx, const wtf_corpus_t *corpus, const char *query, size_t query_sz, size_t limit, wtf_match_t *ranked, size_t *matched)
+{
+  const wtf_index_t *index = corpus->index.map ? &corpus->index : NULL;
+  return rank_entries(ctx, corpus->entries, cvector_size(corpus->entries), index, corpus->postings, corpus->trigrams, &corpus->buckets, query, query_sz, limit, ranked, matched);
+}
+
+/*
+ * Reads the whole `fd` into slabs, splitting it into entries as it goes.
+ *
+ * Reads go straight into the slabs in chunks of up to `READ_SZ`. Pipes get their
+ * buffer enlarged (where allowed) so the writer isn't woken up every 64 KiB,
+ * and the kernel is told to read files ahead aggressively. When the size of the
+ * input is known upfront, the first slab is made big enough to hold all of it.
+ */
+#define READ_SZ ((size_t)4 << 20)
+#define PIPE_SZ (1 << 20)
+
+static bool
+read_input(wtf_corpus_t *corpus, int fd)
+{
+  size_t size_hint = 0;
+  size_t total = 0;
+  ssize_t read_sz = 0;
+  int err = 0;
+  double start = now_secs();
+
+  {
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+      if (S_ISREG(st.st_mode))
+      {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos >= 0 && st.st_size > pos) size_hint = st.st_size - pos + 1;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+      else if (S_ISFIFO(st.st_mode))
+      {
+        /* Fails with EPERM past /proc/sys/fs/pipe-max-size, which is fine. */
+        fcntl(fd, F_SETPIPE_SZ, PIPE_SZ);
+      }
+    }
+  }
+
+  do
+  {
+    size_t avail = 0;
+    char *dst = corpus_reserve(corpus, size_hint, &avail);
+    if (!dst)
+    {
+      err = ENOMEM;
+      break;
+    }
+
+    read_sz = read(fd, dst, avail < READ_SZ ? avail : READ_SZ);
+    wtf_stats.ingest_reads++;
+
+    if (read_sz < 0)
+    {
+      if (errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+
+    corpus_commit(corpus, read_sz);
+    total += read_sz;
+  }
+  while (read_sz);
+
+  corpus_finish(corpus);
+
+  wtf_stats.ingest_bytes += total;
+  wtf_stats.ingest_secs += now_secs() - start;
+
+  errno = err;
+  return err == 0;
+}
+
+bool
+wtf_corpus_read_fd(wtf_corpus_t *corpus, int fd)
+{
+  return read_input(corpus, fd);
+}
+
+bool
+wtf_corpus_feed(wtf_corpus_t *corpus, const char *buf, size_t sz)
+{
+  if (!buf)
+  {
+    corpus_finish(corpus);
+    return true;
+  }
+
+  wtf_stats.ingest_bytes += sz;
+
+  while (sz)
+  {
+    size_t avail = 0;
+    char *dst = corpus_reserve(corpus, sz, &avail);
+    if (!dst)
+    {
+      errno = ENOMEM;
+      return false;
+    }
+
+    size_t n = sz < avail ? sz : avail;
+    memcpy(dst, buf, n);
+    corpus_commit(corpus, n);
+    buf += n;
+    sz -= n;
+  }
+
+  return true;
+}
+
+/*
+ * io_uring ingest for regular files.
+ *
+ * A window of the current slab is carved into `URING_CHUNK_SZ` reads, up to `URING_DEPTH`
+ * of them in flight. Reads complete in any order, but chunks are handed to the line
+ * splitter strictly in file order, as soon as every chunk before them has landed.
+ * This talks to the kernel directly, so there's no dependency on liburing.
+ */
+#define URING_DEPTH 32
+#define URING_CHUNK_SZ ((size_t)1 << 20)
+
+typedef struct
+{
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+}
+wtf_uring_t;
+
+typedef struct
+{
+  size_t off;  /* Offset in the window. */
+  size_t len;
+  size_t done; /* Bytes already read. */
+  bool landed;
+}
+wtf_uring_chunk_t;
+
+static void
+uring_free(wtf_uring_t *ring)
+{
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_sz);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_sz);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_sz);
+  if (ring->fd >= 0) close(ring->fd);
+  ring->fd = -1;
+}
+
+/* Returns false when io_uring isn't available (old kernel, seccomp, disabled by sysctl). */
+static bool
+uring_init(wtf_uring_t *ring)
+{
+  struct io_uring_params p = {0};
+
+  *ring = (wtf_uring_t){ .fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p) };
+  if (ring->fd < 0) return false;
+
+  ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_ring_sz > ring->sq_ring_sz) ring->sq_ring_sz = ring->cq_ring_sz;
+    ring->cq_ring_sz = ring->sq_ring_sz;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) goto uring_init_fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) ring->cq_ring = ring->sq_ring;
+  else ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED) goto uring_init_fail;
+
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto uring_init_fail;
+
+  ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+
+  return true;
+
+uring_init_fail:
+  if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+  if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+  if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+  uring_free(ring);
+  return false;
+}
+
+/* Queues a read; it's only handed to the kernel by `uring_wait`. */
+static void
+uring_queue_read(wtf_uring_t *ring, int fd, char *dst, size_t len, off_t off, unsigned long long tag)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->addr = (unsigned long long)(uintptr_t)dst;
+  sqe->len = len;
+  sqe->user_data = tag;
+
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  wtf_stats.ingest_reads++;
+  wtf_stats.ingest_uring_reads++;
+}
+
+/* Submits `to_submit` queued reads and waits for at least one completion. */
+static bool
+uring_wait(wtf_uring_t *ring, unsigned to_submit)
+{
+  while (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+  {
+    if (errno != EINTR) return false;
+    to_submit = 0;
+  }
+  return true;
+}
+
+/*
+ * Reads the first `size` bytes of the regular file `fd` through io_uring, then the rest
+ * like `read_input`, which decides `ok`. Returns false if nothing was read because
+ * io_uring is unavailable.
+ */
+static bool
+read_input_uring(wtf_corpus_t *corpus, int fd, size_t size, bool *ok)
+{
+  wtf_uring_t ring;
+  if (!uring_init(&ring)) return false;
+
+  wtf_uring_chunk_t chunks[URING_DEPTH];
+  size_t pos = 0; /* File offset of the current window. */
+  bool eof = false;
+  double start = now_secs();
+
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+  while (pos < size && !eof)
+  {
+    size_t avail = 0;
+    char *dst = corpus_reserve(corpus, size - pos + 1, &avail);
+    if (!dst) break;
+
+    size_t base = pos;
+    size_t window = (size - pos) < avail ? (size - pos) : avail;
+    size_t issued = 0;    /* Bytes of the window handed out to chunks. */
+    size_t head = 0;      /* Oldest chunk not yet given to the splitter. */
+    size_t next = 0;      /* Next chunk to issue. */
+    unsigned pending = 0; /* Reads queued but not submitted. */
+    size_t in_flight = 0;
+
+    while (head < next || (issued < window && !eof))
+    {
+      while (!eof && issued < window && next - head < URING_DEPTH)
+      {
+        wtf_uring_chunk_t *c = &chunks[next % URING_DEPTH];
+        *c = (wtf_uring_chunk_t){ .off = issued, .len = window - issued };
+        if (c->len > URING_CHUNK_SZ) c->len = URING_CHUNK_SZ;
+
+        uring_queue_read(&ring, fd, dst + c->off, c->len, base + c->off, next);
+        issued += c->len;
+        next++;
+        pending++;
+        in_flight++;
+      }
+
+      if (!uring_wait(&ring, pending))
+      {
+        eof = true;
+        break;
+      }
+      pending = 0;
+
+      unsigned cq_head = *ring.cq_head;
+      unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; cq_head != cq_tail; cq_head++)
+      {
+        struct io_uring_cqe *cqe = &ring.cqes[cq_head & *ring.cq_mask];
+        wtf_uring_chunk_t *c = &chunks[cqe->user_data % URING_DEPTH];
+        in_flight--;
+
+        if (cqe->res > 0) c->done += cqe->res;
+        if (cqe->res == -EINTR || cqe->res == -EAGAIN || (cqe->res > 0 && c->done < c->len))
+        {
+          /* Short read, go for the rest. */
+          uring_queue_read(&ring, fd, dst + c->off + c->done, c->len - c->done, base + c->off + c->done, cqe->user_data);
+          pending++;
+          in_flight++;
+          continue;
+        }
+
+        /* File got shorter, or an error. Plain reads pick up from there and tell which. */
+        if (c->done < c->len) eof = true;
+        c->landed = true;
+      }
+      __atomic_store_n(ring.cq_head, cq_head, __ATOMIC_RELEASE);
+
+      /* Feed the splitter everything that is contiguous from the start of the window. */
+      while (head < next && chunks[head % URING_DEPTH].landed)
+      {
+        wtf_uring_chunk_t *c = &chunks[head % URING_DEPTH];
+        corpus_commit(corpus, c->done);
+        wtf_stats.ingest_bytes += c->done;
+        pos += c->done;
+        head++;
+
+        /* Nothing past a short chunk is contiguous anymore. */
+        if (c->done < c->len)
+        {
+          while (head < next) chunks[head++ % URING_DEPTH].landed = false;
+          break;
+        }
+      }
+
+    }
+
+    /* Reads still in flight write into the window, so drain them before moving on. */
+    while (in_flight)
+    {
+      if (!uring_wait(&ring, pending)) break;
+      pending = 0;
+      unsigned cq_head = *ring.cq_head;
+      unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      in_flight -= cq_tail - cq_head;
+      __atomic_store_n(ring.cq_head, cq_tail, __ATOMIC_RELEASE);
+    }
+  }
+
+  uring_free(&ring);
+  wtf_stats.ingest_secs += now_secs() - start;
+
+  /* Pick up anything appended since `fstat`, and the last line. */
+  lseek(fd, pos, SEEK_SET);
+  *ok = read_input(corpus, fd);
+
+  return true;
+}
+
+bool
+wtf_corpus_read_path(wtf_corpus_t *corpus, const char *path, int *keep_fd)
+{
+  if (keep_fd) *keep_fd = -1;
+  if (strcmp(path, "-") == 0) return read_input(corpus, STDIN_FILENO);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  bool ok = true;
+  struct stat st;
+  bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (!regular || !read_input_uring(corpus, fd, st.st_size, &ok))
+    ok = read_input(corpus, fd);
+
+  if (keep_fd && regular)
+  {
+    *keep_fd = fd;
+  }
+  else
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+  }
+
+  return ok;
+}
+
+/*
+ * INDEX FILES
+ *
+ * A prebuilt corpus, laid out to be mapped and used as is: a header, a table of
+ * sections, then the sections themselves, each aligned to `INDEX_ALIGN` bytes.
+ *
+ *   TEXT        labels, each followed by a NUL
+ *   FOLDED      the same, case-folded
+ *   OFFSETS     u64 per entry, where its label starts in TEXT (and FOLDED)
+ *   LENGTHS     u32 per entry
+ *   SIGNATURES  u64 per entry, see `signature`
+ *
+ * and, optionally, a trigram index (see TRIGRAMS) over all entries:
+ *
+ *   TRIGRAM_CHUNKS  a `wtf_trigram_chunk_t` per chunk
+ *   TRIGRAM_KEYS    u32 per key
+ *   TRIGRAM_STARTS  u64 per key, plus one
+ *   TRIGRAM_IDS     u16 per id
+ *
+ * Readers skip sections they don't know, so new ones don't need a version bump.
+ * Numbers are stored in the byte order of the writer, and other machines refuse them.
+ */
+#define INDEX_MAGIC "WTFIDX\n"
+#define INDEX_VERSION 1
+#define INDEX_BYTE_ORDER 0x01020304
+#define INDEX_ALIGN 64
+
+#define index_align(n) (((n) + INDEX_ALIGN - 1) & ~(uint64_t)(INDEX_ALIGN - 1))
+
+enum
+{
+  INDEX_TEXT = 1,
+  INDEX_FOLDED,
+  INDEX_OFFSETS,
+  INDEX_LENGTHS,
+  INDEX_SIGNATURES,
+  INDEX_TRIGRAM_CHUNKS,
+  INDEX_TRIGRAM_KEYS,
+  INDEX_TRIGRAM_STARTS,
+  INDEX_TRIGRAM_IDS,
+  INDEX_SECTIONS = INDEX_TRIGRAM_IDS,
+};
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t entries;
+  uint32_t sections; /* Rows in the section table that follows. */
+  uint32_t reserved;
+}
+wtf_index_header_t;
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t offset; /* From the start of the file. */
+  uint64_t size;
+}
+wtf_index_section_t;
+
+/* Buffered writes, remembering the first error instead of checking every call. */
+typedef struct
+{
+  int fd;
+  char *buf;
+  size_t cap;
+  size_t len;
+  uint64_t pos;
+  int err;
+}
+wtf_index_writer_t;
+
+static void
+iw_flush(wtf_index_writer_t *w)
+{
+  char *p = w->buf;
+
+  while (w->len > 0 && !w->err)
+  {
+    ssize_t n = write(w->fd, p, w->len);
+    if (n < 0)
+    {
+      if (errno != EINTR) w->err = errno;
+      continue;
+    }
+    p += n;
+    w->len -= n;
+  }
+  w->len = 0;
+}
+
+static void
+iw_bytes(wtf_index_writer_t *w, const void *bytes, size_t sz)
+{
+  const char *src = bytes;
+  w->pos += sz;
+
+  while (sz > 0)
+  {
+    if (w->len == w->cap) iw_flush(w);
+
+    size_t n = w->cap - w->len < sz ? w->cap - w->len : sz;
+    memcpy(w->buf + w->len, src, n);
+    w->len += n;
+    src += n;
+    sz -= n;
+  }
+}
+
+static void
+iw_folded(wtf_index_writer_t *w, const char *label, size_t sz)
+{
+  w->pos += sz;
+
+  for (size_t i = 0; i < sz; i++)
+  {
+    if (w->len == w->cap) iw_flush(w);
+    w->buf[w->len++] = fold(label[i]);
+  }
+}
+
+/* Zeroes up to the start of the next section. */
+static void
+iw_pad(wtf_index_writer_t *w)
+{
+  static const char zeros[INDEX_ALIGN];
+  iw_bytes(w, zeros, index_align(w->pos) - w->pos);
+}
+
+/*
+ * The file is written next to `path` and renamed over it once complete, so
+ * whoever has the old one mapped keeps a consistent view of it.
+ */
+bool
+wtf_corpus_write_index(const wtf_corpus_t *corpus, const char *path)
+{
+  const wtf_entry_t *entries = corpus->entries;
+  size_t n = cvector_size(entries);
+  uint64_t text_sz = 0;
+
+  /* Trigrams are only stored when they cover everything. */
+  const wtf_trigrams_t *trigrams = corpus->trigrams && corpus->trigrams->count == n ? corpus->trigrams : NULL;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    if (entries[i].label_sz > UINT32_MAX)
+    {
+      errno = EFBIG;
+      return false;
+    }
+    text_sz += entries[i].label_sz + 1;
+  }
+
+  wtf_index_header_t header = {
+    .magic = INDEX_MAGIC,
+    .version = INDEX_VERSION,
+    .byte_order = INDEX_BYTE_ORDER,
+    .entries = n,
+    .sections = trigrams ? INDEX_SECTIONS : INDEX_SIGNATURES,
+  };
+
+  wtf_index_section_t table[INDEX_SECTIONS];
+  uint64_t sizes[INDEX_SECTIONS] = { text_sz, text_sz, n * sizeof(uint64_t), n * sizeof(uint32_t), n * sizeof(uint64_t) };
+  if (trigrams)
+  {
+    sizes[INDEX_TRIGRAM_CHUNKS - 1] = trigrams->nchunks * sizeof(wtf_trigram_chunk_t);
+    sizes[INDEX_TRIGRAM_KEYS - 1] = trigrams->nkeys * sizeof(uint32_t);
+    sizes[INDEX_TRIGRAM_STARTS - 1] = (trigrams->nkeys + 1) * sizeof(uint64_t);
+    sizes[INDEX_TRIGRAM_IDS - 1] = trigrams->nids * sizeof(uint16_t);
+  }
+  uint64_t at = index_align(sizeof(header) + header.sections * sizeof(table[0]));
+
+  for (uint32_t k = 0; k < header.sections; k++)
+  {
+    table[k] = (wtf_index_section_t){ .type = k + 1, .offset = at, .size = sizes[k] };
+    at = index_align(at + sizes[k]);
+  }
+
+  size_t path_sz = strlen(path);
+  char *tmp = wtf_malloc(path_sz + sizeof(".tmp"));
+  wtf_index_writer_t w = { .fd = -1, .cap = 1 << 20 };
+  w.buf = wtf_malloc(w.cap);
+
+  if (!tmp || !w.buf)
+  {
+    w.err = ENOMEM;
+    goto write_index_cleanup;
+  }
+
+  memcpy(tmp, path, path_sz);
+  memcpy(tmp + path_sz, ".tmp", sizeof(".tmp"));
+
+  w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w.fd < 0)
+  {
+    w.err = errno;
+    goto write_index_cleanup;
+  }
+
+  iw_bytes(&w, &header, sizeof(header));
+  iw_bytes(&w, table, header.sections * sizeof(table[0]));
+  iw_pad(&w);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    iw_bytes(&w, entries[i].label, entries[i].label_sz);
+    iw_bytes(&w, "", 1);
+  }
+  iw_pad(&w);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    iw_folded(&w, entries[i].label, entries[i].label_sz);
+    iw_bytes(&w, "", 1);
+  }
+  iw_pad(&w);
+
+  for (uint64_t i = 0, off = 0; i < n; off += entries[i].label_sz + 1, i++)
+    iw_bytes(&w, &off, sizeof(off));
+  iw_pad(&w);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    uint32_t len = entries[i].label_sz;
+    iw_bytes(&w, &len, sizeof(len));
+  }
+  iw_pad(&w);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    uint64_t sig = signature(entries[i].label, entries[i].label_sz);
+    iw_bytes(&w, &sig, sizeof(sig));
+  }
+
+  if (trigrams)
+  {
+    iw_pad(&w);
+    iw_bytes(&w, trigrams->chunks, sizes[INDEX_TRIGRAM_CHUNKS - 1]);
+    iw_pad(&w);
+    iw_bytes(&w, trigrams->keys, sizes[INDEX_TRIGRAM_KEYS - 1]);
+    iw_pad(&w);
+    iw_bytes(&w, trigrams->starts, sizes[INDEX_TRIGRAM_STARTS - 1]);
+    iw_pad(&w);
+    iw_bytes(&w, trigrams->ids, sizes[INDEX_TRIGRAM_IDS - 1]);
+  }
+  iw_flush(&w);
+
+  if (close(w.fd) < 0 && !w.err) w.err = errno;
+  w.fd = -1;
+
+  if (!w.err && rename(tmp, path) < 0) w.err = errno;
+  if (w.err) unlink(tmp);
+
+write_index_cleanup:
+  if (w.fd >= 0)
+  {
+    close(w.fd);
+    unlink(tmp);
+  }
+  wtf_free(w.buf);
+  wtf_free(tmp);
+
+  errno = w.err;
+  return w.err == 0;
+}
+
+/*
+ * Checks the trigram sections of an index file covering `count` entries. The runs
+ * must be in order and fit in a chunk, and every chunk's keys within KEYS.
+ */
+static bool
+index_trigrams_valid(const wtf_trigrams_t *t, size_t count)
+{
+  if (t->nchunks != (count + POSTING_CHUNK_SZ - 1) >> POSTING_CHUNK_BITS
+      || t->starts[0] != 0 || t->starts[t->nkeys] != t->nids)
+    return false;
+
+  for (size_t k = 0; k < t->nchunks; k++)
+    if (t->chunks[k].keys > t->nkeys || t->chunks[k].nkeys > t->nkeys - t->chunks[k].keys)
+      return false;
+
+  for (size_t r = 0; r < t->nkeys; r++)
+    if (t->starts[r + 1] < t->starts[r] || t->starts[r + 1] - t->starts[r] > POSTING_CHUNK_SZ)
+      return false;
+
+  return true;
+}
+
+/*
+ * Checks the header and section table of a mapped index file, and points `index` into it.
+ * If the file holds trigrams, `trigrams` is pointed into it too.
+ */
+static bool
+index_load(wtf_index_t *index, wtf_trigrams_t *trigrams, void *map, size_t map_sz)
+{
+  const wtf_index_header_t *header = map;
+  uint64_t text_sz = 0;
+  uint64_t folded_sz = 0;
+  uint64_t starts_sz = 0;
+
+  if (map_sz < sizeof(*header)
+      || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+      || header->version != INDEX_VERSION
+      || header->byte_order != INDEX_BYTE_ORDER
+      || header->sections > (map_sz - sizeof(*header)) / sizeof(wtf_index_section_t))
+    return false;
+
+  /* Each entry takes at least 8 bytes, keeps the size checks below from overflowing. */
+  if (header->entries > map_sz / sizeof(uint64_t)) return false;
+
+  *index = (wtf_index_t){ .map = map, .map_sz = map_sz, .count = header->entries };
+
+  const wtf_index_section_t *table = (const wtf_index_section_t*)(header + 1);
+  for (uint32_t k = 0; k < header->sections; k++)
+  {
+    const wtf_index_section_t *s = &table[k];
+    if (s->offset > map_sz || s->size > map_sz - s->offset || s->offset % 8) return false;
+
+    const char *data = (const char*)map + s->offset;
+    uint64_t n = index->count;
+
+    switch (s->type)
+    {
+      case INDEX_TEXT:
+        index->text = data;
+        text_sz = s->size;
+        break;
+
+      case INDEX_FOLDED:
+        index->folded = data;
+        folded_sz = s->size;
+        break;
+
+      case INDEX_OFFSETS:
+        if (s->size != n * sizeof(uint64_t)) return false;
+        index->offsets = (const uint64_t*)data;
+        break;
+
+      case INDEX_LENGTHS:
+        if (s->size != n * sizeof(uint32_t)) return false;
+        index->lengths = (const uint32_t*)data;
+        break;
+
+      case INDEX_SIGNATURES:
+        if (s->size != n * sizeof(uint64_t)) return false;
+        index->signatures = (const uint64_t*)data;
+        break;
+
+      case INDEX_TRIGRAM_CHUNKS:
+        if (s->size % sizeof(wtf_trigram_chunk_t)) return false;
+        trigrams->chunks = (const wtf_trigram_chunk_t*)data;
+        trigrams->nchunks = s->size / sizeof(wtf_trigram_chunk_t);
+        break;
+
+      case INDEX_TRIGRAM_KEYS:
+        trigrams->keys = (const uint32_t*)data;
+        trigrams->nkeys = s->size / sizeof(uint32_t);
+        break;
+
+      case INDEX_TRIGRAM_STARTS:
+        trigrams->starts = (const uint64_t*)data;
+        starts_sz = s->size;
+        break;
+
+      case INDEX_TRIGRAM_IDS:
+        trigrams->ids = (const uint16_t*)data;
+        trigrams->nids = s->size / sizeof(uint16_t);
+        break;
+    }
+  }
+
+  if (trigrams->chunks || trigrams->keys || trigrams->starts || trigrams->ids)
+  {
+    if (!trigrams->chunks || !trigrams->keys || !trigrams->starts || !trigrams->ids
+        || starts_sz != (trigrams->nkeys + 1) * sizeof(uint64_t)
+        || !index_trigrams_valid(trigrams, index->count))
+      return false;
+    trigrams->count = index->count;
+  }
+
+  if (!index->text || !index->folded || !index->offsets || !index->lengths || !index->signatures
+      || folded_sz != text_sz)
+    return false;
+
+  /* Everything else trusts these, so make sure every label lies within TEXT. */
+  for (uint64_t i = 0; i < index->count; i++)
+    if (index->offsets[i] >= text_sz || index->lengths[i] >= text_sz - index->offsets[i])
+      return false;
+
+  return true;
+}
+
+/*
+ * Maps an index file. Entries point straight into the mapping, but building the entry
+ * array and the length buckets from the offset and length tables is still O(n). The
+ * rest of the file is left to fault in as it's touched, not read ahead all at once.
+ */
+wtf_corpus_t*
+wtf_corpus_open_index(const char *path, char delim)
+{
+  double start = now_secs();
+  int err = 0;
+  wtf_corpus_t *corpus = NULL;
+  void *map = MAP_FAILED;
+  wtf_trigrams_t trigrams = {0};
+  struct stat st;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+
+  if (fstat(fd, &st) < 0)
+  {
+    err = errno;
+    goto open_index_fail;
+  }
+
+  if (st.st_size == 0)
+  {
+    err = EINVAL;
+    goto open_index_fail;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    err = errno;
+    goto open_index_fail;
+  }
+
+  corpus = wtf_corpus_new(delim);
+  if (!corpus)
+  {
+    err = ENOMEM;
+    goto open_index_fail;
+  }
+
+  if (!index_load(&corpus->index, &trigrams, map, st.st_size))
+  {
+    err = EINVAL;
+    goto open_index_fail;
+  }
+
+  if (trigrams.chunks)
+  {
+    corpus->trigrams = wtf_malloc(sizeof(wtf_trigrams_t));
+    if (!corpus->trigrams)
+    {
+      err = ENOMEM;
+      goto open_index_fail;
+    }
+    *corpus->trigrams = trigrams;
+    wtf_stats.trigram_bytes = trigrams_bytes(&trigrams);
+  }
+
+  {
+    wtf_index_t *index = &corpus->index;
+
+    cvector_reserve(corpus->entries, index->count ? index->count : 1);
+    for (uint64_t i = 0; i < index->count; i++)
+      corpus->entries[i] = wtf_entry_new(index->text + index->offsets[i], index->lengths[i]);
+    cvector_set_size(corpus->entries, index->count);
+    buckets_add(&corpus->buckets, corpus->entries, index->count);
+  }
+
+  close(fd);
+
+  wtf_stats.index_bytes += st.st_size;
+  wtf_stats.index_secs += now_secs() - start;
+
+  return corpus;
+
+open_index_fail:
+  if (corpus) corpus->index.map = NULL; /* Unmapped below. */
+  wtf_corpus_free(corpus);
+  if (map != MAP_FAILED) munmap(map, st.st_size);
+  close(fd);
+
+  errno = err;
+  return NULL;
+}
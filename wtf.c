@@ -1,10 +1,72 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
-#include <wctype.h>
+
+#include "wtf.h"
+
+/*
+ * STATISTICS
+ *
+ * What the front end counts on top of `wtf_stats`, for `--stats`.
+ * Counters touched by worker threads are updated atomically.
+ */
+typedef struct
+{
+  size_t typing_allocs; /* Allocations the matcher thread made ranking queries. */
+  size_t warm_allocs;   /* How many of them came once warmed up, see MATCHER_WARMUP; should be none. */
+  size_t keystrokes;    /* Query edits handled. */
+  size_t frames;        /* Finder frames presented. */
+  size_t tty_bytes;     /* Bytes sent to the terminal for them. */
+  size_t tty_writes;    /* write() calls needed for that, ideally one per frame. */
+  size_t rows_drawn;    /* List rows drawn for them. */
+  size_t scrolls;       /* Times the terminal scrolled the list instead. */
+  size_t previews;      /* Preview commands started. */
+  size_t previews_killed; /* How many of them were killed, their entry no longer selected. */
+  size_t preview_hits;  /* Previews shown straight from the cache. */
+  size_t out_bytes;     /* Bytes of results written. */
+  size_t out_writes;    /* write() calls needed for them. */
+  size_t queries;       /* Queries answered in batch mode. */
+  size_t requests;      /* Queries answered in daemon mode. */
+  double query_secs;
+}
+wtf_app_stats_t;
+
+wtf_app_stats_t stats = {0};
+
+#define stat_add(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* cvector and termbox allocate through libwtf, so their allocations are counted too. */
+#define cvector_clib_malloc  wtf_malloc
+#define cvector_clib_calloc  wtf_calloc
+#define cvector_clib_realloc wtf_realloc
+#define cvector_clib_free    wtf_free
+
+/* Must be set before `config.h` pulls in the termbox header. */
+#define tb_malloc  wtf_malloc
+#define tb_realloc wtf_realloc
+#define tb_free    wtf_free
 
 #include "config.h"
 #include "cvector.h"
@@ -12,133 +74,234 @@
 #define TB_IMPL
 #include "termbox2.h"
 
+double
+now_secs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * OUTPUT
+ *
+ * A plain buffer in front of write(2). The memory comes from the caller and nothing
+ * is formatted through stdio, so dumping millions of results doesn't allocate at all.
+ */
 typedef struct
 {
-  char *label;
-  size_t label_sz;
-  int distance;
-  int inaccuracy;
-  bool *markers;
+  int fd;
+  char *buf;
+  size_t cap;
+  size_t len;
 }
-wtf_entry_t;
+wtf_out_t;
 
-wtf_entry_t
-wtf_entry_new(char *label, size_t lsz)
+void
+out_write(int fd, const char *buf, size_t sz)
 {
-  bool *markers = malloc(lsz);
-  memset(markers, false, lsz);
+  stat_add(out_bytes, sz);
 
-  return (wtf_entry_t){
-    .label = label,
-    .label_sz = lsz,
-    .distance = 0,
-    .inaccuracy = 0,
-    .markers = markers,
-  };
+  while (sz > 0)
+  {
+    ssize_t n = write(fd, buf, sz);
+    stat_add(out_writes, 1);
+
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buf += n;
+    sz -= n;
+  }
 }
 
 void
-str_rate_free(wtf_entry_t *entry)
+out_flush(wtf_out_t *out)
 {
-  free(entry->markers);
+  out_write(out->fd, out->buf, out->len);
+  out->len = 0;
 }
 
-#define eq_case_insensitive(a, b) \
-  (towlower((a)) == towlower((b)))
+void
+out_bytes(wtf_out_t *out, const char *bytes, size_t sz)
+{
+  if (out->len + sz > out->cap)
+  {
+    out_flush(out);
 
-int
-minimum(int x, int y)
+    /* Wouldn't fit anyway, don't bother copying. */
+    if (sz > out->cap)
+    {
+      out_write(out->fd, bytes, sz);
+      return;
+    }
+  }
+
+  memcpy(out->buf + out->len, bytes, sz);
+  out->len += sz;
+}
+
+#define out_str(out, s) out_bytes((out), (s), sizeof(s) - 1)
+
+void
+out_char(wtf_out_t *out, char c)
 {
-  return x < y ? x : y;
+  if (out->len == out->cap) out_flush(out);
+  out->buf[out->len++] = c;
 }
 
-int
-minimum3(int x, int y, int z)
+void
+out_int(wtf_out_t *out, long long v)
 {
-  return x < y ? minimum(x, z) : minimum(y, z);
+  char digits[24];
+  size_t i = sizeof(digits);
+  unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+
+  do digits[--i] = '0' + u % 10; while (u /= 10);
+  if (v < 0) digits[--i] = '-';
+
+  out_bytes(out, digits + i, sizeof(digits) - i);
 }
 
-/*
- * Levenshtein distance.
- * Implemented from Wikipedia.org: https://en.wikipedia.org/wiki/Levenshtein_distance
- *
- * Tweaked array indexing though.
- */
-int
-ldistance(char* a, size_t asz, char* b, size_t bsz)
+/* Writes `str` as a JSON string literal. Bytes >= 0x80 are passed through untouched. */
+void
+out_json_str(wtf_out_t *out, const char *str, size_t sz)
 {
-  int d[asz+1][bsz+1];
-  memset(d, 0, (asz+1 * sizeof(int)) * (bsz+1 * sizeof(int)));
+  static const char hex[] = "0123456789abcdef";
 
-  for (size_t i = 0; i < asz; i++) d[i][0] = i;
-  for (size_t i = 0; i < bsz; i++) d[0][i] = i;
+  out_char(out, '"');
 
-  for (size_t j = 0; j < bsz; j++)
+  size_t run = 0; /* Start of the current stretch of bytes that need no escaping. */
+  for (size_t i = 0; i < sz; i++)
   {
-    for (size_t i = 0; i < asz; i++)
-    {
-      int cost = (a[i] == b[j]) ? 0 : 1;
+    unsigned char c = str[i];
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
 
-      d[i+1][j+1] = minimum3(
-        d[i][j+1] + 1,
-        d[i+1][j] + 1,
-        d[i][j] + cost
-      );
+    out_bytes(out, str + run, i - run);
+    run = i + 1;
+
+    switch (c)
+    {
+      case '"':  out_str(out, "\\\""); break;
+      case '\\': out_str(out, "\\\\"); break;
+      case '\n': out_str(out, "\\n"); break;
+      case '\t': out_str(out, "\\t"); break;
+      case '\r': out_str(out, "\\r"); break;
+      default:
+        out_str(out, "\\u00");
+        out_char(out, hex[c >> 4]);
+        out_char(out, hex[c & 0xf]);
     }
   }
+  out_bytes(out, str + run, sz - run);
+
+  out_char(out, '"');
+}
 
-  return d[asz][bsz];
+typedef enum
+{
+  OUTPUT_PLAIN,
+  OUTPUT_TSV,
+  OUTPUT_JSONL,
 }
+wtf_output_t;
 
 /*
- * TODO: Document/explain this algorithm.
+ * How matches are printed, in every mode:
+ *
+ * plain: label, followed by `delim`
+ * tsv:   index <TAB> distance <TAB> label
+ * jsonl: {"index":N,"label":"...","distance":N,"inaccuracy":N,"positions":[N,...]}
+ *
+ * Indices count entries from 0 in input order, positions are byte offsets into the label.
+ * Lower distances are better.
  */
+typedef struct
+{
+  wtf_out_t out;
+  wtf_output_t format;
+  char delim;
+}
+wtf_printer_t;
+
 void
-wtf_entry_rate(wtf_entry_t *entry, char *pat, size_t pat_sz)
+out_match_json(wtf_out_t *out, size_t index, wtf_match_t *match, const char *query, size_t query_sz)
 {
-  char *l = entry->label;
-  size_t lsz = entry->label_sz;
-  bool *marks = entry->markers;
+  const wtf_entry_t *entry = match->entry;
+
+  out_str(out, "{\"index\":");
+  out_int(out, index);
+  out_str(out, ",\"label\":");
+  out_json_str(out, entry->label, entry->label_sz);
+  out_str(out, ",\"distance\":");
+  out_int(out, match->distance);
+  out_str(out, ",\"inaccuracy\":");
+  out_int(out, match->inaccuracy);
+  out_str(out, ",\"positions\":[");
 
-  ssize_t most_distant_marker = -1;
+  size_t i = 0;
+  size_t j = 0;
+  ssize_t pos;
+  while ((pos = wtf_mark_next(entry, query, query_sz, &i, &j)) >= 0)
+  {
+    if (j > 1) out_char(out, ',');
+    out_int(out, pos);
+  }
 
-  /* Clear old match markers. */
-  memset(marks, false, lsz);
+  out_str(out, "]}");
+}
 
-  entry->inaccuracy = pat_sz;
+void
+print_match(wtf_printer_t *p, size_t index, wtf_match_t *match, const char *query, size_t query_sz)
+{
+  const wtf_entry_t *entry = match->entry;
 
-  size_t j = 0; /* Index in pattern. */
-  for (size_t i = 0; i < lsz && j < pat_sz; i++)
+  switch (p->format)
   {
-    if (eq_case_insensitive(l[i], pat[j]))
-    {
-      if (most_distant_marker < 0) most_distant_marker = i;
-      marks[i] = true; /* Mark matched character. */
-      entry->inaccuracy--;
-      j++;
-    }
+    case OUTPUT_PLAIN:
+      out_bytes(&p->out, entry->label, entry->label_sz);
+      out_char(&p->out, p->delim);
+      break;
+
+    case OUTPUT_TSV:
+      out_int(&p->out, index);
+      out_char(&p->out, '\t');
+      out_int(&p->out, match->distance);
+      out_char(&p->out, '\t');
+      out_bytes(&p->out, entry->label, entry->label_sz);
+      out_char(&p->out, '\n');
+      break;
+
+    case OUTPUT_JSONL:
+      out_match_json(&p->out, index, match, query, query_sz);
+      out_char(&p->out, '\n');
+      break;
   }
-
-  entry->inaccuracy += (pat_sz - j);
-  entry->distance = ldistance(
-    l, lsz,
-    pat, pat_sz
-  ) + most_distant_marker + entry->inaccuracy;
 }
 
-int
-wtf_entry_cmp(const wtf_entry_t **a, const wtf_entry_t **b)
+/*
+ * The lines the finder draws in: the whole terminal on the alternate screen, or with
+ * `--height`, a few of them below the cursor on the normal one (see VIEW).
+ */
+struct
 {
-  return (*a)->distance - (*b)->distance;
+  int top;
+  int height;
+  bool inline_;
+  bool split; /* The right half of the list's lines shows previews. */
+  int width;  /* Columns of the list. */
 }
+view;
 
-/* Calculates Y coordinate from the bottom or top of the terminal. */
+/* Calculates Y coordinate from the bottom or top of the view. */
 #ifdef DIRECTION_TOP
-#define calcy(y) (y)
+#define calcy(y) (view.top + (y))
 #endif
 
 #ifdef DIRECTION_BTM
-#define calcy(y) (tb_height() - (y + 1))
+#define calcy(y) (view.top + view.height - (y + 1))
 #endif
 
 void
@@ -154,322 +317,3078 @@ scroll_to_fit(size_t *scroll, size_t selected, size_t max_visible)
   }
 }
 
-#define copy_item_refs(src, dst)         \
-  do {                                   \
-    size_t src_sz = cvector_size((src)); \
-    cvector_reserve((dst), src_sz);      \
-    for (size_t i = 0; i < src_sz; i++)  \
-      (dst)[i] = &(src)[i];              \
-    cvector_set_size((dst), src_sz);     \
-  } while (0)
-
-wtf_entry_t*
-finder_start(cvector(wtf_entry_t) *list)
+/* Writes `n` shortened to a few digits and a suffix, as in "1200", "31K" or "30M". */
+void
+format_count(char *buf, size_t sz, size_t n)
 {
+  static const char suffixes[] = "KMGT";
+  if (n < 10000)
   {
-    int tb_status = tb_init();
-    if (tb_status)
-    {
-      fprintf(stderr, "initializing termbox failed with code %d\n", tb_status);
-      return NULL;
-    }
+    snprintf(buf, sz, "%zu", n);
+    return;
   }
 
-  tb_set_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
-  tb_set_cursor(0, calcy(0));
+  size_t i = 0;
+  n /= 1000;
+  while (n >= 1000 && i + 1 < sizeof(suffixes) - 1)
+  {
+    n /= 1000;
+    i++;
+  }
+  snprintf(buf, sz, "%zu%c", n, suffixes[i]);
+}
 
-  struct tb_event ev;
+/* How many matches the finder asks a ranker for at first. */
+#define FINDER_WANT 512
 
-  /* The entry we return. */
-  wtf_entry_t *entry = NULL;
+/*
+ * One ranking, as the matcher hands it to the finder. Nothing in it changes once it's
+ * published, so the finder can keep drawing from it while the next one is made.
+ */
+typedef struct
+{
+  uint64_t seq;                 /* The post it answers, see MATCHER. */
+  cvector(char) query;          /* What was ranked, for highlighting. */
+  cvector(wtf_match_t) matches; /* Best first. */
+  size_t want;                  /* How many of them were asked for. */
+  size_t matched;               /* How many entries match in all; `matches` may hold less. */
+  size_t total;                 /* Number of all entries. */
+  bool partial;                 /* Published while ranking was still underway. */
+  size_t done;                  /* If so, how many entries it had gone through. */
 
-  wtf_entry_t **filtered = NULL;
+  /*
+   * Copies of the matched entries, so the snapshot outlives any change to the corpus,
+   * and their indices in it. For a remote ranker, the labels live in the response.
+   */
+  cvector(char) buf;
+  cvector(wtf_entry_t) entries;
+  cvector(size_t) indices;
+}
+wtf_snapshot_t;
 
-  char *query = NULL;
-  size_t cursor = 0;
+wtf_snapshot_t*
+snapshot_new(void)
+{
+  wtf_snapshot_t *snap = wtf_calloc(1, sizeof(wtf_snapshot_t));
+  if (!snap) return NULL;
+
+  cvector_init(snap->query, 32, NULL);
+  cvector_init(snap->matches, FINDER_WANT, NULL);
+  cvector_init(snap->entries, FINDER_WANT, NULL);
+  cvector_init(snap->indices, FINDER_WANT, NULL);
+  return snap;
+}
 
-  size_t max_visible = tb_height() - 2;
-  size_t selected = 0;
-  size_t scroll = 0;
+void
+snapshot_free(wtf_snapshot_t *snap)
+{
+  if (!snap) return;
+
+  cvector_free(snap->query);
+  cvector_free(snap->matches);
+  cvector_free(snap->buf);
+  cvector_free(snap->entries);
+  cvector_free(snap->indices);
+  wtf_free(snap);
+}
 
-  /*
-   * We set the destructor to NULL, and we copy references to items in `list`.
-   */
-  cvector_init(filtered, 255, NULL);
-  copy_item_refs(*list, filtered);
+/* Points the matches at copies of their entries; `base` is where the corpus' entries start. */
+void
+snapshot_detach(wtf_snapshot_t *snap, const wtf_entry_t *base)
+{
+  size_t n = cvector_size(snap->matches);
 
-  cvector_init(query, 32, NULL);
+  cvector_set_size(snap->entries, 0);
+  cvector_set_size(snap->indices, 0);
+  cvector_reserve(snap->entries, n ? n : 1);
+  cvector_reserve(snap->indices, n ? n : 1);
 
-  do
+  for (size_t i = 0; i < n; i++)
   {
-    if (cvector_size(filtered) == 0)
-    {
-      /* Go to the beginning if we get no matches and then we get matches again instead of going at the end of the list. */
-      selected = 0;
-      scroll = 0;
-    }
-    else
-    {
-      /*
-       * Reset scroll and select the last visible item if `filtered` shrank below the selector.
-       * Then, just adjust scroll again to fix selector going out of sight.
-       */
-      if (selected >= cvector_size(filtered))
-      {
-        selected = cvector_size(filtered) - 1;
-        scroll = 0;
-      }
-      scroll_to_fit(&scroll, selected, max_visible);
-    }
-
-    /*
-     * DRAWING
-     */
-    tb_clear();
-    {
-      /* Print query and set the cursor at the end of it. */
-      tb_print(0, calcy(0), QUERY_PREFIX_COLOR, TB_DEFAULT, QUERY_PREFIX);
-      tb_printf(QUERY_PREFIX_SZ + 1, calcy(0), TB_DEFAULT, TB_DEFAULT, "%.*s", cvector_size(query), query);
-      tb_set_cursor(QUERY_PREFIX_SZ + 1 + cursor, calcy(0));
-
-      /*
-       * Draw the status bar:
-       * - L/A -------------------------------------------
-       * Where:
-       *   L -> number of listed entries
-       *   A -> number of all entries
-       */
-      {
-        size_t w = 0;
-
-        tb_printf_ex(
-          0,
-          calcy(1),
-          STATUS_BAR_COLOR,
-          TB_DEFAULT,
-          &w,
-          "%s %ld/%ld",
-          STATUS_BAR_FILL,
-          cvector_size(filtered),
-          cvector_size(*list)
-        );
-
-        const size_t remaining_dashes = tb_width();
-        for (size_t i = (w + 1); i < remaining_dashes; i += STATUS_BAR_FILL_SZ)
-          tb_print(i, calcy(1), STATUS_BAR_COLOR, TB_DEFAULT, STATUS_BAR_FILL);
-      }
+    snap->entries[i] = *snap->matches[i].entry;
+    snap->indices[i] = snap->matches[i].entry - base;
+    snap->matches[i].entry = &snap->entries[i];
+  }
+  cvector_set_size(snap->entries, n);
+  cvector_set_size(snap->indices, n);
+}
 
-      /* Draw the filtered list. */
-      size_t visible = cvector_size(filtered);
-      if (visible > max_visible) visible = max_visible;
+size_t
+snapshot_index_of(const wtf_snapshot_t *snap, const wtf_entry_t *entry)
+{
+  return snap->indices[entry - snap->entries];
+}
 
-      for (size_t i = 0; i < visible; i++)
-      {
-        size_t real_idx = scroll + i;
-        wtf_entry_t *item = filtered[real_idx];
-        size_t primary_fg_attr = TB_DEFAULT;
+/*
+ * Where the finder gets its matches from: the corpus in this process,
+ * or a daemon over a socket (`--connect`).
+ */
+typedef struct wtf_ranker
+{
+  /*
+   * Fills `snap` with the best matches for `query` (every entry, for an empty query),
+   * at least `want` of them if there are that many, and with its counts.
+   */
+  void (*rank)(struct wtf_ranker *self, const char *query, size_t query_sz, size_t want, wtf_snapshot_t *snap);
 
-        if (real_idx == selected)
-        {
-          tb_print(0, calcy(2 + i), SELECTOR_COLOR, TB_DEFAULT, SELECTOR);
-          primary_fg_attr |= TB_BOLD;
-        }
+  /* Index of `entry`, from `snap`, in the corpus, for printing. */
+  size_t (*index_of)(struct wtf_ranker *self, const wtf_snapshot_t *snap, const wtf_entry_t *entry);
 
-        for (size_t j = 0; j < item->label_sz; j++)
-        {
-          size_t fg_attr = primary_fg_attr;
-          if (item->markers[j]) fg_attr |= TB_RED | TB_BOLD;
-          tb_set_cell(SELECTOR_SZ + 1 + j, calcy(2 + i), item->label[j], fg_attr, TB_DEFAULT);
-        }
-      }
-    }
-    tb_present();
+  /*
+   * Adds input to what gets ranked, never during `rank`. A NULL `buf` marks its end.
+   * Only rankers over a corpus in this process take any.
+   */
+  void (*feed)(struct wtf_ranker *self, const char *buf, size_t sz);
 
-    /*
-     * EVENT LOGIC
-     */
-    tb_poll_event(&ev);
+  /* Makes a partial snapshot, holding matches straight from the corpus, outlive it. */
+  void (*detach)(struct wtf_ranker *self, wtf_snapshot_t *snap);
 
-    if (ev.type == TB_EVENT_RESIZE)
-    {
-      max_visible = tb_height() - 2;
-      scroll = 0; /* Reset scroll after resizing. */
-      scroll_to_fit(&scroll, selected, max_visible);
-    }
+  /*
+   * Looks up entry `index` and rates it against `query` (whether it matches or not),
+   * or with a NULL `query`, only looks it up. Never during `rank`. Only rankers over
+   * a corpus in this process have the entries at hand.
+   */
+  void (*rate)(struct wtf_ranker *self, size_t index, const char *query, size_t query_sz, wtf_match_t *match);
 
-    if (ev.key == TB_KEY_ESC) goto start_finder_cleanup;
-    if (ev.type == TB_EVENT_KEY)
-    {
-      bool query_update = false;
+  void *ctx;
 
-      switch (ev.key)
-      {
-        case 0:
-          cvector_insert(query, cursor, ev.ch);
-          cursor++;
-          query_update = true;
-          break;
+  /* Gets partial results during `rank`, from rankers that have any. */
+  wtf_progress_fn progress;
+  void *progress_arg;
+}
+wtf_ranker_t;
 
-        case TB_KEY_BACKSPACE:
-        case TB_KEY_BACKSPACE2:
-          if (cvector_size(query) > 0 && cursor > 0)
-          {
-            cursor--;
-            cvector_erase(query, cursor);
-            query_update = true;
-          }
-          break;
+typedef struct
+{
+  wtf_corpus_t *corpus;
+  const wtf_entry_t *list; /* The corpus' entries as of the last ranking. */
+  size_t list_sz;
+  wtf_ctx_t *query_ctx; /* Reused for every keystroke. */
+}
+wtf_local_t;
 
-        case TB_KEY_ARROW_LEFT:
-          cursor -= (cursor ? 1 : 0);
-          break;
+/*
+ * Only the best `want` are kept; the finder asks again if it scrolls past them.
+ * They're detached from the corpus, which may grow while the snapshot is shown.
+ */
+void
+local_rank(wtf_ranker_t *self, const char *query, size_t query_sz, size_t want, wtf_snapshot_t *snap)
+{
+  wtf_local_t *local = self->ctx;
+  local->list = wtf_corpus_entries(local->corpus, &local->list_sz);
+  size_t room = (want && want < local->list_sz) ? want : local->list_sz;
 
-        case TB_KEY_ARROW_RIGHT:
-          cursor += ((cursor < cvector_size(query)) ? 1 : 0);
-          break;
+  cvector_reserve(snap->matches, room ? room : 1);
+  wtf_ctx_set_progress(local->query_ctx, self->progress, self->progress_arg, PROGRESS_INTERVAL);
 
-        case TB_KEY_CTRL_A:
-          cursor = 0;
-          break;
+  size_t n = wtf_corpus_rank(local->query_ctx, local->corpus, query, query_sz, want, snap->matches, &snap->matched);
+  cvector_set_size(snap->matches, n);
+  snapshot_detach(snap, local->list);
+  snap->total = local->list_sz;
+}
 
-        case TB_KEY_CTRL_E:
-          cursor = cvector_size(query);
-          break;
+size_t
+local_index_of(wtf_ranker_t *self, const wtf_snapshot_t *snap, const wtf_entry_t *entry)
+{
+  (void)self;
+  return snapshot_index_of(snap, entry);
+}
 
-        case TB_KEY_ARROW_UP:
-          if (cvector_size(filtered))
-          {
+void
+local_feed(wtf_ranker_t *self, const char *buf, size_t sz)
+{
+  wtf_local_t *local = self->ctx;
+  if (!wtf_corpus_feed(local->corpus, buf, sz))
+    fprintf(stderr, "wtf: reading input failed: %s\n", strerror(errno));
+}
 
-#ifdef DIRECTION_TOP
-            if (selected > 0) selected--;
-            else selected = cvector_size(filtered) - 1;
-#else /* DIRECTION_TOP */
-            selected = (selected + 1) % cvector_size(filtered);
-#endif /* DIRECTION_TOP */
+void
+local_detach(wtf_ranker_t *self, wtf_snapshot_t *snap)
+{
+  snapshot_detach(snap, ((wtf_local_t*)self->ctx)->list);
+}
 
-            scroll_to_fit(&scroll, selected, max_visible);
-          }
-          break;
+void
+local_rate(wtf_ranker_t *self, size_t index, const char *query, size_t query_sz, wtf_match_t *match)
+{
+  wtf_local_t *local = self->ctx;
+  size_t n;
+  const wtf_entry_t *entries = wtf_corpus_entries(local->corpus, &n);
 
-        case TB_KEY_ARROW_DOWN:
-          if (cvector_size(filtered))
-          {
+  *match = (wtf_match_t){ .entry = &entries[index] };
+  if (query) wtf_rate(local->query_ctx, match->entry, query, query_sz, match);
+}
 
-#ifdef DIRECTION_TOP
-            selected = (selected + 1) % cvector_size(filtered);
-#else /* DIRECTION_TOP */
-            if (selected > 0) selected--;
-            else selected = cvector_size(filtered) - 1;
-#endif /* DIRECTION_TOP */
+#define local_ranker(local) ((wtf_ranker_t){ \
+    .rank = local_rank,                       \
+    .index_of = local_index_of,               \
+    .feed = local_feed,                       \
+    .detach = local_detach,                   \
+    .rate = local_rate,                       \
+    .ctx = (local),                           \
+  })
 
-            scroll_to_fit(&scroll, selected, max_visible);
-          }
-          break;
+/*
+ * MATCHER
+ *
+ * Ranking runs on a thread of its own, so the finder keeps handling keys and redrawing
+ * while it works. The finder posts queries; the matcher answers the latest one (older
+ * posts it didn't get to are dropped) and publishes the result as a snapshot.
+ *
+ * Snapshots change hands through atomic slots: `latest`, the newest one not picked up
+ * yet, and `pool`, the ones nobody uses, to be refilled. Whoever swaps one out of a
+ * slot owns it. All MATCHER_SNAPSHOTS are made up front, so once they have grown big
+ * enough, ranking doesn't allocate anymore.
+ *
+ * A long ranking also publishes partial snapshots as it goes, and is abandoned as
+ * soon as a newer query is posted. Every snapshot published is signalled on `notify`,
+ * an eventfd the finder waits on along with the terminal.
+ *
+ * Input still streaming in is handed over with `matcher_feed` and added to the corpus
+ * between rankings, after which the latest query is ranked again, under the same post.
+ */
+/* One shown, one published and not picked up yet, one ranked into and a partial one being filled. */
+#define MATCHER_SNAPSHOTS 4
+/* Posts (keystrokes) after which, once the input is all in, every snapshot has grown to its working size. */
+#define MATCHER_WARMUP (2 * MATCHER_SNAPSHOTS)
 
-        case TB_KEY_ENTER:
-          entry = (cvector_size(filtered) > 0) ? filtered[selected] : NULL;
-          goto start_finder_cleanup;
-      }
+typedef struct
+{
+  wtf_ranker_t *ranker;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* Something was posted. */
+  pthread_cond_t done; /* Something was published. */
+
+  /* Under `lock`. */
+  cvector(char) query;
+  size_t want;
+  uint64_t posted;    /* Posts so far, also read atomically. */
+  uint64_t taken;     /* The last one the matcher started on. */
+  uint64_t published; /* The last one answered in full. */
+  bool quit;
+
+  cvector(char) input; /* Fed, not yet added. */
+  bool input_end;
+  bool streaming;      /* Input was fed and hasn't ended yet. */
+
+  wtf_snapshot_t *latest;
+  wtf_snapshot_t *pool[MATCHER_SNAPSHOTS];
+  int notify;
+
+  /* The matcher's own. */
+  wtf_snapshot_t *working; /* Being ranked into. */
+  bool abandoned;
+  cvector(char) feeding;
+}
+wtf_matcher_t;
 
-      if (query_update)
-      {
-        /*
-         * Recompute the query when it's not empy.
-         * If it is empty, clear markers and list all entries.
-         */
-        size_t query_sz = cvector_size(query);
+/* Hands a snapshot nobody looks at anymore back for reuse. */
+void
+matcher_recycle(wtf_matcher_t *m, wtf_snapshot_t *snap)
+{
+  if (!snap) return;
 
-        if (query_sz > 0)
-        {
-          /* We don't need to worry about destroying the strings. */
-          cvector_set_size(filtered, 0);
-          for (size_t i = 0; i < cvector_size(*list); i++) {
-            wtf_entry_rate(&(*list)[i], query, query_sz);
-            if ((*list)[i].inaccuracy <= FUZZ_MAX_INACCURACY) cvector_push_back(filtered, &(*list)[i]);
-          }
+  for (int i = 0; i < MATCHER_SNAPSHOTS; i++)
+  {
+    wtf_snapshot_t *empty = NULL;
+    if (__atomic_compare_exchange_n(&m->pool[i], &empty, snap, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+  }
+  snapshot_free(snap);
+}
 
-          qsort(
-            filtered,
-            cvector_size(filtered),
-            sizeof(wtf_entry_t*),
-            (int (*)(const void*, const void*))wtf_entry_cmp
-          );
-        }
-        else
-        {
-          /* Clear match markers - since we aren't matching against anything. */
-          for (size_t i = 0; i < cvector_size(*list); i++)
-            memset(filtered[i]->markers, false, filtered[i]->label_sz);
-          copy_item_refs(*list, filtered);
-        }
-      }
-    }
+/* Takes a snapshot to fill from the pool. It's never empty while no more than MATCHER_SNAPSHOTS are in play. */
+wtf_snapshot_t *
+matcher_reuse(wtf_matcher_t *m)
+{
+  for (int i = 0; i < MATCHER_SNAPSHOTS; i++)
+  {
+    wtf_snapshot_t *snap = __atomic_exchange_n(&m->pool[i], NULL, __ATOMIC_ACQ_REL);
+    if (snap) return snap;
   }
-  while (true);
+  return snapshot_new();
+}
 
-start_finder_cleanup:
-    cvector_free(query);
-    cvector_free(filtered);
+/* Publishes what the current ranking has so far, or calls it off if it's stale already. */
+bool
+matcher_progress(void *arg, const wtf_match_t *ranked, size_t n, size_t matched, size_t done, size_t total)
+{
+  wtf_matcher_t *m = arg;
+  wtf_snapshot_t *work = m->working;
 
-    tb_shutdown();
+  if (__atomic_load_n(&m->posted, __ATOMIC_ACQUIRE) != work->seq)
+  {
+    m->abandoned = true;
+    return false;
+  }
 
-    return entry;
+  wtf_snapshot_t *snap = matcher_reuse(m);
+
+  cvector_set_size(snap->query, 0);
+  cvector_reserve(snap->query, cvector_size(work->query) + 1);
+  memcpy(snap->query, work->query, cvector_size(work->query));
+  cvector_set_size(snap->query, cvector_size(work->query));
+
+  cvector_set_size(snap->matches, 0);
+  cvector_reserve(snap->matches, n ? n : 1);
+  memcpy(snap->matches, ranked, n * sizeof(wtf_match_t));
+  cvector_set_size(snap->matches, n);
+  qsort(snap->matches, n, sizeof(wtf_match_t), (int (*)(const void*, const void*))wtf_match_cmp);
+  if (m->ranker->detach) m->ranker->detach(m->ranker, snap);
+
+  snap->seq = work->seq;
+  snap->want = work->want;
+  snap->matched = matched;
+  snap->total = total;
+  snap->partial = true;
+  snap->done = done;
+
+  matcher_recycle(m, __atomic_exchange_n(&m->latest, snap, __ATOMIC_ACQ_REL));
+  eventfd_write(m->notify, 1);
+  return true;
 }
 
-size_t
-read_to_vec(cvector(char) *vec, size_t buf_size, FILE *stream)
+void*
+matcher_main(void *arg)
 {
-  size_t read = 0;
-  size_t i = 0;
+  wtf_matcher_t *m = arg;
 
-  do
+  pthread_mutex_lock(&m->lock);
+  while (true)
   {
-    if (i + buf_size > cvector_capacity(*vec))
-      cvector_reserve(*vec, cvector_capacity(*vec) * 2);
+    while (!m->quit && m->taken == m->posted && !cvector_size(m->input) && !m->input_end)
+      pthread_cond_wait(&m->wake, &m->lock);
+    if (m->quit) break;
+
+    if (cvector_size(m->input) || m->input_end)
+    {
+      cvector(char) input = m->input;
+      bool end = m->input_end;
+      m->input = m->feeding;
+      m->input_end = false;
+      if (end) m->streaming = false;
+      pthread_mutex_unlock(&m->lock);
+
+      if (cvector_size(input)) m->ranker->feed(m->ranker, input, cvector_size(input));
+      if (end) m->ranker->feed(m->ranker, NULL, 0);
+      cvector_set_size(input, 0);
+      m->feeding = input;
+
+      pthread_mutex_lock(&m->lock);
+      if (!m->posted) continue;
+    }
+
+    /* Only the matcher's own: the finder keeps allocating for drawing, previews and such meanwhile. */
+    size_t allocs_before = wtf_thread_allocs();
+    wtf_snapshot_t *snap = matcher_reuse(m);
+
+    snap->seq = m->taken = m->posted;
+    snap->want = m->want;
+    bool warm = !m->streaming && snap->seq > MATCHER_WARMUP;
+    cvector_set_size(snap->query, 0);
+    cvector_reserve(snap->query, cvector_size(m->query) + 1);
+    memcpy(snap->query, m->query, cvector_size(m->query));
+    cvector_set_size(snap->query, cvector_size(m->query));
+    pthread_mutex_unlock(&m->lock);
+
+    m->working = snap;
+    m->abandoned = false;
+    m->ranker->rank(m->ranker, snap->query, cvector_size(snap->query), snap->want, snap);
+    snap->partial = false;
+    stat_add(typing_allocs, wtf_thread_allocs() - allocs_before);
+    if (warm) stat_add(warm_allocs, wtf_thread_allocs() - allocs_before);
+
+    if (m->abandoned)
+    {
+      matcher_recycle(m, snap);
+      pthread_mutex_lock(&m->lock);
+      continue;
+    }
+
+    matcher_recycle(m, __atomic_exchange_n(&m->latest, snap, __ATOMIC_ACQ_REL));
+    eventfd_write(m->notify, 1);
 
-    read = fread((char*)(*vec + i), sizeof(char), buf_size, stream);
-    i += read;
-    cvector_set_size(*vec, i);
+    pthread_mutex_lock(&m->lock);
+    m->published = snap->seq;
+    pthread_cond_broadcast(&m->done);
   }
-  while (read);
+  pthread_mutex_unlock(&m->lock);
 
-  return i;
+  return NULL;
 }
 
-void
-print_help(FILE *stream)
+bool
+matcher_start(wtf_matcher_t *m, wtf_ranker_t *ranker)
 {
-#define HELP \
-  "Usage: wtf [OPTIONS]\n" \
-  "\n" \
-  "Simple interactive command line fuzzy finder.\n" \
-  "Designed to take any kind of new-line separated list from STDIN.\n" \
-  "\n" \
-  "Options:\n" \
-  "  -h, --help     display this help and exit\n" \
-  "\n"
+  *m = (wtf_matcher_t){ .ranker = ranker };
+  ranker->progress = matcher_progress;
+  ranker->progress_arg = m;
+  cvector_init(m->query, 32, NULL);
+  m->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m->notify < 0)
+  {
+    cvector_free(m->query);
+    return false;
+  }
+  for (int i = 0; i < MATCHER_SNAPSHOTS; i++) m->pool[i] = snapshot_new();
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->wake, NULL);
+  pthread_cond_init(&m->done, NULL);
 
-  fprintf(stream, HELP);
+  return pthread_create(&m->thread, NULL, matcher_main, m) == 0;
+}
+
+void
+matcher_stop(wtf_matcher_t *m)
+{
+  pthread_mutex_lock(&m->lock);
+  m->quit = true;
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+  pthread_join(m->thread, NULL);
+
+  snapshot_free(m->latest);
+  for (int i = 0; i < MATCHER_SNAPSHOTS; i++) snapshot_free(m->pool[i]);
+  cvector_free(m->query);
+  cvector_free(m->input);
+  cvector_free(m->feeding);
+  close(m->notify);
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->wake);
+  pthread_cond_destroy(&m->done);
 }
 
-#define push_entry(list, buf, offset, size) \
-  do { \
-    char *entry = (char*)((buf) + (offset)); \
-    cvector_push_back((list), str_rate_init((char*)((buf) + (offset)), (size))); \
-    entry[(size)] = '\0'; \
-  } while (0)
+/* Asks for the best `want` matches of `query`. Returns the number of the post. */
+uint64_t
+matcher_post(wtf_matcher_t *m, const char *query, size_t query_sz, size_t want)
+{
+  pthread_mutex_lock(&m->lock);
+  cvector_set_size(m->query, 0);
+  cvector_reserve(m->query, query_sz + 1);
+  memcpy(m->query, query, query_sz);
+  cvector_set_size(m->query, query_sz);
+  m->want = want;
+  uint64_t seq = __atomic_add_fetch(&m->posted, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+
+  return seq;
+}
 
-int
-main(int argc, char **argv)
+/* Hands over more input, or with a NULL `buf`, its end. */
+void
+matcher_feed(wtf_matcher_t *m, const char *buf, size_t sz)
 {
-  if (argc > 1)
+  pthread_mutex_lock(&m->lock);
+  if (buf)
   {
-    if (strcmp(argv[1], "--help") == 0
-        || strcmp(argv[1], "-h") == 0)
-    {
+    size_t at = cvector_size(m->input);
+    if (cvector_capacity(m->input) < at + sz) cvector_reserve(m->input, 2 * (at + sz));
+    memcpy(m->input + at, buf, sz);
+    cvector_set_size(m->input, at + sz);
+    m->streaming = true;
+  }
+  else m->input_end = true;
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+}
+
+/*
+ * Swaps `*current` for the latest snapshot, if there's a new one. With `seq`, waits
+ * until post `seq` is answered first. Returns whether `*current` changed.
+ */
+bool
+matcher_take(wtf_matcher_t *m, wtf_snapshot_t **current, uint64_t seq)
+{
+  if (seq)
+  {
+    pthread_mutex_lock(&m->lock);
+    while (m->published < seq) pthread_cond_wait(&m->done, &m->lock);
+    pthread_mutex_unlock(&m->lock);
+  }
+
+  wtf_snapshot_t *snap = __atomic_exchange_n(&m->latest, NULL, __ATOMIC_ACQ_REL);
+  if (!snap) return false;
+
+  matcher_recycle(m, *current);
+  *current = snap;
+  return true;
+}
+
+/*
+ * VIEW
+ *
+ * termbox always takes over the alternate screen. For `--height`, it's set up the same
+ * way minus that, and minus clearing the screen: the finder gets the lines below the
+ * cursor on the normal screen, scrolling the terminal to make room if needed, and
+ * leaves them blank on exit, with the cursor back where it was. The rest of the
+ * screen is never written to, so frames cost as much as the view is tall.
+ */
+
+/* Lines `height` stands for, at least a prompt, the status bar and one row. */
+int
+view_lines(unsigned height, bool percent)
+{
+  int lines = percent ? (long)tb_height() * height / 100 : (int)height;
+  if (lines > tb_height()) lines = tb_height();
+  return lines < 3 ? 3 : lines;
+}
+
+/* Asks the terminal which line the cursor is on (DSR). Returns -1 if it doesn't answer. */
+int
+view_cursor_line(void)
+{
+  tb_send("\x1b[6n", 4);
+  bytebuf_flush(&global.out, global.wfd);
+
+  double deadline = now_secs() + 1;
+  while (true)
+  {
+    /* Keys typed meanwhile stay in termbox's input buffer, for later. */
+    struct bytebuf_t *in = &global.in;
+    for (size_t i = 0; i + 1 < in->len; i++)
+    {
+      if (in->buf[i] != '\x1b' || in->buf[i + 1] != '[') continue;
+
+      int line = 0;
+      size_t j = i + 2;
+      for (; j < in->len && in->buf[j] >= '0' && in->buf[j] <= '9'; j++) line = line * 10 + in->buf[j] - '0';
+      if (j == i + 2 || j >= in->len || in->buf[j++] != ';') continue;
+      while (j < in->len && in->buf[j] >= '0' && in->buf[j] <= '9') j++;
+      if (j >= in->len || in->buf[j++] != 'R') continue;
+
+      memmove(in->buf + i, in->buf + j, in->len - j);
+      in->len -= j - i;
+      return line - 1;
+    }
+
+    int left = (deadline - now_secs()) * 1000;
+    struct pollfd pfd = { .fd = global.rfd, .events = POLLIN };
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) return -1;
+
+    char buf[64];
+    ssize_t n = read(global.rfd, buf, sizeof(buf));
+    if (n <= 0) return -1;
+    bytebuf_nputs(in, buf, n);
+  }
+}
+
+/* Blanks the view and everything below it, on the terminal and in termbox's buffers. */
+void
+view_erase(int from)
+{
+  tb_sendf("\x1b[m\x1b[%d;1H\x1b[J", from + 1);
+  global.last_fg = ~global.fg;
+  global.last_bg = ~global.bg;
+  global.last_x = global.last_y = -1;
+  cellbuf_clear(&global.front);
+  cellbuf_clear(&global.back);
+}
+
+/* `tb_init`, for `height` lines (or percent of the terminal) below the cursor. */
+int
+view_init_inline(unsigned height, bool percent)
+{
+  int rv;
+  int ttyfd = open("/dev/tty", O_RDWR);
+  if (ttyfd < 0) return TB_ERR_INIT_OPEN;
+
+  tb_reset();
+  global.ttyfd_open = 1;
+  global.ttyfd = global.rfd = global.wfd = ttyfd;
+
+  do
+  {
+    if_err_break(rv, init_term_attrs());
+    if_err_break(rv, init_term_caps());
+    if_err_break(rv, init_cap_trie());
+    if_err_break(rv, init_resize_handler());
+    if_err_break(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_KEYPAD]));
+    if_err_break(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+    if_err_break(rv, update_term_size());
+    if_err_break(rv, init_cellbuf());
+    global.initialized = 1;
+  }
+  while (0);
+
+  if (rv != TB_OK)
+  {
+    tb_deinit();
+    return rv;
+  }
+
+  /* Nothing termbox does may clear the screen from now on, not even on resizes or exit. */
+  global.caps[TB_CAP_CLEAR_SCREEN] = "";
+  global.caps[TB_CAP_EXIT_CA] = "";
+
+  /* Make room: going down at the last line scrolls the terminal. */
+  view.inline_ = true;
+  view.height = view_lines(height, percent);
+  tb_send("\r", 1);
+  for (int i = 1; i < view.height; i++) tb_send("\n", 1);
+
+  int bottom = view_cursor_line();
+  view.top = (bottom < 0 ? tb_height() - 1 : bottom) - (view.height - 1);
+  if (view.top < 0) view.top = 0;
+  return TB_OK;
+}
+
+/* Fits the view to the terminal, once set up or resized, keeping it where it was if it still fits. */
+void
+view_resize(unsigned height, bool percent)
+{
+  view.width = view.split ? tb_width() / 2 : tb_width();
+  if (!view.inline_)
+  {
+    view.top = 0;
+    view.height = tb_height();
+    return;
+  }
+
+  int from = view.top;
+  view.height = view_lines(height, percent);
+  if (view.top + view.height > tb_height()) view.top = tb_height() - view.height;
+  view_erase(from < view.top ? from : view.top);
+}
+
+/* Leaves the view blank and the cursor where it started, for whatever is printed next. */
+void
+view_leave(void)
+{
+  if (!view.inline_) return;
+
+  view_erase(view.top);
+  tb_sendf("\x1b[%d;1H", view.top + 1);
+  global.cursor_x = global.cursor_y = -1;
+}
+
+/*
+ * PREVIEW
+ *
+ * `--preview CMD` runs CMD through `sh -c` for the selected entry, with every `{}` in
+ * it replaced by the (quoted) label, and shows what it prints next to the list.
+ *
+ * Commands run in the background, at most PREVIEW_JOBS at once, each in a process
+ * group of its own so it can be killed with everything it started. The finder only
+ * reads their output when epoll says there is some, so a slow command never holds up
+ * typing or moving around. A command whose entry is no longer selected is killed.
+ *
+ * What finished commands printed goes into a cache of at most PREVIEW_CACHE_BYTES,
+ * sorted by entry index, which drops the previews shown the longest ago first.
+ */
+typedef struct
+{
+  size_t index;   /* Entry previewed. */
+  char *text;     /* cvector */
+  uint64_t used;  /* When it was last asked for, see `preview_find`. */
+}
+wtf_preview_cached_t;
+
+typedef struct
+{
+  pid_t pid;      /* 0 if the slot is free. */
+  int out;        /* Read end of its stdout, -1 once read to the end or killed. */
+  int pidfd;      /* Readable once it exits. */
+  size_t index;   /* Entry previewed, SIZE_MAX if free or killed. */
+  cvector(char) text;
+}
+wtf_preview_job_t;
+
+typedef struct
+{
+  const char *cmd;
+  int epfd;
+  uint32_t tag;  /* Epoll tag of the first job's stdout, see `preview_handle`. */
+  sigset_t mask; /* Signal mask for the commands. */
+
+  wtf_preview_job_t jobs[PREVIEW_JOBS];
+
+  /* The entry to show, and the command for it if it has yet to start. */
+  size_t want;
+  cvector(char) pending;
+
+  cvector(wtf_preview_cached_t) cache;
+  size_t cache_bytes;
+  uint64_t clock;
+}
+wtf_preview_t;
+
+void
+preview_init(wtf_preview_t *p, const char *cmd, int epfd, uint32_t tag, const sigset_t *mask)
+{
+  *p = (wtf_preview_t){ .cmd = cmd, .epfd = epfd, .tag = tag, .mask = *mask, .want = SIZE_MAX };
+  for (int i = 0; i < PREVIEW_JOBS; i++) p->jobs[i] = (wtf_preview_job_t){ .out = -1, .pidfd = -1, .index = SIZE_MAX };
+}
+
+/* Returns the cached preview of entry `index` (marking it used), or NULL. */
+wtf_preview_cached_t *
+preview_find(wtf_preview_t *p, size_t index, size_t *at)
+{
+  size_t lo = 0, hi = cvector_size(p->cache);
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p->cache[mid].index < index) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (at) *at = lo;
+  if (lo == cvector_size(p->cache) || p->cache[lo].index != index) return NULL;
+
+  p->cache[lo].used = ++p->clock;
+  return &p->cache[lo];
+}
+
+/* What a cached preview counts against PREVIEW_CACHE_BYTES: its text, and its node even if the text is empty. */
+size_t
+preview_cost(const char *text)
+{
+  return sizeof(wtf_preview_cached_t) + sizeof(cvector_metadata_t) + cvector_capacity(text);
+}
+
+/* Caches what a job printed, dropping the least recently used previews to make room. */
+void
+preview_store(wtf_preview_t *p, size_t index, char *text)
+{
+  size_t sz = preview_cost(text);
+  if (preview_find(p, index, NULL))
+  {
+    cvector_free(text);
+    return;
+  }
+
+  while (cvector_size(p->cache) && p->cache_bytes + sz > PREVIEW_CACHE_BYTES)
+  {
+    size_t oldest = 0;
+    for (size_t i = 1; i < cvector_size(p->cache); i++)
+      if (p->cache[i].used < p->cache[oldest].used) oldest = i;
+
+    p->cache_bytes -= preview_cost(p->cache[oldest].text);
+    cvector_free(p->cache[oldest].text);
+    cvector_erase(p->cache, oldest);
+  }
+
+  size_t at;
+  preview_find(p, index, &at);
+  cvector_insert(p->cache, at, ((wtf_preview_cached_t){ .index = index, .text = text, .used = ++p->clock }));
+  p->cache_bytes += sz;
+}
+
+/* Reads what job `i` printed so far. Returns false once it is all read. */
+bool
+preview_read(wtf_preview_t *p, int i)
+{
+  wtf_preview_job_t *job = &p->jobs[i];
+  while (true)
+  {
+    size_t sz = cvector_size(job->text);
+    if (sz >= PREVIEW_MAX_BYTES) return false;
+
+    size_t room = PREVIEW_MAX_BYTES - sz < 4096 ? PREVIEW_MAX_BYTES - sz : 4096;
+    cvector_reserve(job->text, sz + room);
+    ssize_t got = read(job->out, job->text + sz, room);
+    if (got > 0) cvector_set_size(job->text, sz + got);
+    else return got < 0 && (errno == EAGAIN || errno == EINTR);
+  }
+}
+
+/* Stops reading job `i`, caching what it printed unless it was killed. */
+void
+preview_close(wtf_preview_t *p, int i)
+{
+  wtf_preview_job_t *job = &p->jobs[i];
+  if (job->out < 0) return;
+
+  /* Children spawned meanwhile may still share it, so closing it isn't enough for epoll. */
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, job->out, NULL);
+  close(job->out);
+  job->out = -1;
+
+  if (job->index != SIZE_MAX)
+  {
+    /* Never NULL, even if nothing was printed: an empty preview is still a preview. */
+    cvector_reserve(job->text, 1);
+    cvector_shrink_to_fit(job->text);
+    preview_store(p, job->index, job->text);
+  }
+  else
+  {
+    cvector_free(job->text);
+  }
+  job->text = NULL;
+}
+
+/*
+ * Kills job `i` and all it started, e.g. because its entry is no longer selected, even
+ * if it's done printing: it would hold on to its slot. It's reaped once its pidfd says so.
+ */
+void
+preview_kill(wtf_preview_t *p, int i)
+{
+  wtf_preview_job_t *job = &p->jobs[i];
+  if (job->pid == 0 || job->index == SIZE_MAX) return;
+
+  kill(-job->pid, SIGKILL);
+  job->index = SIZE_MAX;
+  preview_close(p, i);
+  stats.previews_killed++;
+}
+
+/* Starts the pending command, if a slot is free. */
+void
+preview_spawn(wtf_preview_t *p)
+{
+  if (cvector_size(p->pending) == 0) return;
+
+  int i = 0;
+  while (i < PREVIEW_JOBS && p->jobs[i].pid) i++;
+  if (i == PREVIEW_JOBS) return;
+
+  wtf_preview_job_t *job = &p->jobs[i];
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) return;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+  /* The finder blocks the signals it quits on; commands get them as usual. */
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setsigmask(&attr, &p->mask);
+
+  extern char **environ;
+  char *argv[] = { "sh", "-c", p->pending, NULL };
+  pid_t pid;
+  int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+
+  int pidfd = err ? -1 : syscall(SYS_pidfd_open, pid, 0);
+  struct epoll_event out_ev = { .events = EPOLLIN, .data.u32 = p->tag + 2 * i };
+  struct epoll_event pid_ev = { .events = EPOLLIN, .data.u32 = p->tag + 2 * i + 1 };
+  if (err || pidfd < 0
+      || epoll_ctl(p->epfd, EPOLL_CTL_ADD, fds[0], &out_ev) < 0
+      || epoll_ctl(p->epfd, EPOLL_CTL_ADD, pidfd, &pid_ev) < 0)
+  {
+    if (!err)
+    {
+      kill(-pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+    }
+    if (pidfd >= 0) close(pidfd);
+    close(fds[0]);
+
+    /* Shown as the preview instead of trying again on every frame. */
+    const char *reason = strerror(err ? err : errno);
+    char *text = NULL;
+    cvector_reserve(text, strlen(reason) + 1);
+    for (const char *c = reason; *c; c++) cvector_push_back(text, *c);
+    preview_store(p, p->want, text);
+    cvector_clear(p->pending);
+    return;
+  }
+
+  *job = (wtf_preview_job_t){ .pid = pid, .out = fds[0], .pidfd = pidfd, .index = p->want };
+  cvector_clear(p->pending);
+  stats.previews++;
+}
+
+/*
+ * Makes entry `index` (SIZE_MAX for none) the one to preview: kills the commands for
+ * any other, and starts one for it unless its preview is cached or on its way.
+ */
+void
+preview_select(wtf_preview_t *p, size_t index, const wtf_entry_t *entry)
+{
+  if (index == p->want) return;
+  p->want = index;
+  cvector_clear(p->pending);
+
+  bool running = false;
+  for (int i = 0; i < PREVIEW_JOBS; i++)
+  {
+    if (p->jobs[i].index == index) running = true;
+    else preview_kill(p, i);
+  }
+  if (index == SIZE_MAX || running) return;
+  if (preview_find(p, index, NULL))
+  {
+    stats.preview_hits++;
+    return;
+  }
+
+  /* Every `{}` becomes the label in single quotes, with its own quotes as '\''. */
+  for (const char *c = p->cmd; *c; c++)
+  {
+    if (c[0] != '{' || c[1] != '}')
+    {
+      cvector_push_back(p->pending, *c);
+      continue;
+    }
+
+    cvector_push_back(p->pending, '\'');
+    for (size_t j = 0; j < entry->label_sz; j++)
+    {
+      if (entry->label[j] != '\'')
+      {
+        cvector_push_back(p->pending, entry->label[j]);
+        continue;
+      }
+      for (const char *q = "'\\''"; *q; q++) cvector_push_back(p->pending, *q);
+    }
+    cvector_push_back(p->pending, '\'');
+    c++;
+  }
+  cvector_push_back(p->pending, '\0');
+
+  preview_spawn(p);
+}
+
+/*
+ * Handles epoll tag `tag - p->tag`, even for a job's stdout, odd for its pidfd.
+ * Returns whether the preview to show changed.
+ */
+bool
+preview_handle(wtf_preview_t *p, uint32_t tag)
+{
+  int i = (tag - p->tag) / 2;
+  wtf_preview_job_t *job = &p->jobs[i];
+  bool shown = job->index == p->want && job->index != SIZE_MAX;
+
+  /* Events for a job handled earlier in the same batch may find its slot reused, or free. */
+  if (job->pid == 0) return false;
+
+  if ((tag - p->tag) % 2 == 0)
+  {
+    if (job->out >= 0 && !preview_read(p, i)) preview_close(p, i);
+    return shown;
+  }
+
+  siginfo_t info = { 0 };
+  if (waitid(P_PID, job->pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) return false;
+
+  /* It exited: take what's left in the pipe, kill whatever it left behind and reap it. */
+  if (job->out >= 0)
+  {
+    preview_read(p, i);
+    preview_close(p, i);
+  }
+  kill(-job->pid, SIGKILL);
+  waitpid(job->pid, NULL, 0);
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+  close(job->pidfd);
+  *job = (wtf_preview_job_t){ .out = -1, .pidfd = -1, .index = SIZE_MAX };
+
+  preview_spawn(p);
+  return shown;
+}
+
+/* What to show for the selected entry: its cached preview, or what its command printed so far. */
+const char *
+preview_text(wtf_preview_t *p, size_t *sz)
+{
+  wtf_preview_cached_t *cached = preview_find(p, p->want, NULL);
+  if (cached)
+  {
+    *sz = cvector_size(cached->text);
+    return cached->text;
+  }
+
+  for (int i = 0; i < PREVIEW_JOBS; i++)
+  {
+    if (p->jobs[i].index != p->want || p->want == SIZE_MAX) continue;
+    *sz = cvector_size(p->jobs[i].text);
+    return p->jobs[i].text;
+  }
+
+  *sz = 0;
+  return NULL;
+}
+
+/* Kills every command still running, and frees the cache. */
+void
+preview_free(wtf_preview_t *p)
+{
+  for (int i = 0; i < PREVIEW_JOBS; i++)
+  {
+    wtf_preview_job_t *job = &p->jobs[i];
+    if (job->pid == 0) continue;
+
+    kill(-job->pid, SIGKILL);
+    waitpid(job->pid, NULL, 0);
+    if (job->out >= 0) close(job->out);
+    close(job->pidfd);
+    cvector_free(job->text);
+  }
+
+  for (size_t i = 0; i < cvector_size(p->cache); i++) cvector_free(p->cache[i].text);
+  cvector_free(p->cache);
+  cvector_free(p->pending);
+}
+
+/*
+ * SELECTION
+ *
+ * With `--multi`, the entries picked so far: one bit per entry index. Picking all of
+ * millions of entries flips whole words, and printing them in input order is a walk
+ * over the bits set.
+ */
+typedef struct
+{
+  cvector(uint64_t) bits;
+  size_t count; /* Bits set. */
+}
+wtf_selection_t;
+
+/* Makes room for entries up to `n`, unpicked. */
+void
+selection_grow(wtf_selection_t *sel, size_t n)
+{
+  size_t words = (n + 63) / 64;
+  size_t had = cvector_size(sel->bits);
+  if (words <= had) return;
+
+  cvector_reserve(sel->bits, words);
+  memset(sel->bits + had, 0, (words - had) * sizeof(uint64_t));
+  cvector_set_size(sel->bits, words);
+}
+
+bool
+selection_has(const wtf_selection_t *sel, size_t index)
+{
+  return index / 64 < cvector_size(sel->bits) && (sel->bits[index / 64] >> (index % 64) & 1);
+}
+
+void
+selection_toggle(wtf_selection_t *sel, size_t index)
+{
+  selection_grow(sel, index + 1);
+  sel->bits[index / 64] ^= (uint64_t)1 << (index % 64);
+  if (selection_has(sel, index)) sel->count++;
+  else sel->count--;
+}
+
+/* Toggles the first `n` entries, i.e. every one there is. */
+void
+selection_toggle_all(wtf_selection_t *sel, size_t n)
+{
+  selection_grow(sel, n);
+  for (size_t w = 0; w < n / 64; w++) sel->bits[w] = ~sel->bits[w];
+  if (n % 64) sel->bits[n / 64] ^= ((uint64_t)1 << (n % 64)) - 1;
+
+  sel->count = 0;
+  for (size_t w = 0; w < cvector_size(sel->bits); w++) sel->count += __builtin_popcountll(sel->bits[w]);
+}
+
+/* Toggles every match in `snap`. */
+void
+selection_toggle_listed(wtf_selection_t *sel, wtf_ranker_t *ranker, const wtf_snapshot_t *snap)
+{
+  for (size_t i = 0; i < cvector_size(snap->matches); i++)
+    selection_toggle(sel, ranker->index_of(ranker, snap, snap->matches[i].entry));
+}
+
+/* Prints every picked entry, in input order, through the printer's buffer. */
+void
+selection_print(const wtf_selection_t *sel, wtf_ranker_t *ranker, wtf_printer_t *printer, const char *query, size_t query_sz)
+{
+  /* Only the plain format goes without distances. */
+  const char *rate_query = printer->format == OUTPUT_PLAIN ? NULL : query;
+
+  for (size_t w = 0; w < cvector_size(sel->bits); w++)
+  {
+    for (uint64_t bits = sel->bits[w]; bits; bits &= bits - 1)
+    {
+      size_t index = w * 64 + __builtin_ctzll(bits);
+      wtf_match_t match;
+      ranker->rate(ranker, index, rate_query, query_sz, &match);
+      print_match(printer, index, &match, query, query_sz);
+    }
+  }
+  out_flush(&printer->out);
+}
+
+/*
+ * RENDERING
+ *
+ * The finder's screen is made of regions: the prompt, the status bar and one per row
+ * of the list. Each remembers what it was last drawn from and is only drawn again when
+ * that changed, so a frame where only the selection moved touches two rows. Frames
+ * where nothing changed aren't presented at all.
+ *
+ * When the list scrolls, the terminal is asked to scroll the rows already on it (with
+ * a scroll region) and only the rows scrolled in are drawn, instead of `tb_present`
+ * rewriting every row that moved.
+ *
+ * Frames go out in a single write, as synchronized updates (DEC mode 2026) if the
+ * terminal answers that it has them, so it never shows one half drawn.
+ */
+typedef struct
+{
+  size_t index; /* Of the entry in the corpus, or SIZE_MAX for an empty row. */
+  bool selected;
+  bool picked;  /* With `--multi`. */
+}
+wtf_row_t;
+
+typedef struct
+{
+  bool stale; /* Everything has to be drawn again, e.g. after a resize. */
+
+  /* The prompt as drawn. */
+  cvector(char) query;
+  size_t cursor;
+
+  /* The status bar as drawn. */
+  size_t matched;
+  size_t total;
+  int percent; /* -1 once ranking was complete. */
+  size_t picked;
+
+  /* The list as drawn: the query highlighted, how far it was scrolled, and every row from the top. */
+  cvector(char) marked;
+  size_t scroll;
+  cvector(wtf_row_t) rows;
+
+  /* The preview as drawn. */
+  const char *preview;
+  size_t preview_sz;
+}
+wtf_screen_t;
+
+void
+screen_free(wtf_screen_t *scr)
+{
+  cvector_free(scr->query);
+  cvector_free(scr->marked);
+  cvector_free(scr->rows);
+}
+
+/* Whether `vec` holds exactly `str`, then makes it so. */
+bool
+screen_same(cvector(char) *vec, const char *str, size_t sz)
+{
+  if (cvector_size(*vec) == sz && memcmp(*vec, str, sz) == 0) return true;
+
+  cvector_reserve(*vec, sz + 1);
+  memcpy(*vec, str, sz);
+  cvector_set_size(*vec, sz);
+  return false;
+}
+
+/* Blanks the first `width` columns of line `y`. */
+void
+screen_blank(int y, int width)
+{
+  for (int x = 0; x < width; x++) tb_set_cell(x, y, ' ', TB_DEFAULT, TB_DEFAULT);
+}
+
+#define SYNC_BEGIN "\x1b[?2026h"
+#define SYNC_END   "\x1b[?2026l"
+#define SYNC_QUERY "\x1b[?2026$p" /* DECRQM, answered with SYNC_REPLY "<state>$y". */
+#define SYNC_REPLY "\x1b[?2026;"
+
+bool screen_sync = false;
+
+/* Picks the answer to SYNC_QUERY out of the terminal's input, see `tb_set_func`. */
+int
+screen_sync_reply(struct tb_event *event, size_t *consumed)
+{
+  const char *in = global.in.buf;
+  size_t len = global.in.len;
+  size_t i = sizeof(SYNC_REPLY) - 1;
+
+  if (memcmp(in, SYNC_REPLY, len < i ? len : i) != 0) return TB_ERR;
+  if (len < i) return TB_ERR_NEED_MORE;
+
+  int state = 0;
+  for (; i < len && in[i] >= '0' && in[i] <= '9'; i++) state = state * 10 + in[i] - '0';
+  if (len < i + 2) return TB_ERR_NEED_MORE;
+  if (in[i] != '$' || in[i + 1] != 'y') return TB_ERR;
+
+  /* 0 is an unknown mode, 4 one that's permanently off. */
+  screen_sync = state >= 1 && state <= 3;
+  event->type = 0; /* Nothing for the finder to act on. */
+  *consumed = i + 2;
+  return TB_OK;
+}
+
+/*
+ * `tb_present`, except that the frame, along with whatever was queued for it while
+ * drawing (scrolling, moving the cursor), goes out in one write.
+ */
+void
+screen_present(void)
+{
+  struct bytebuf_t *out = &global.out;
+
+  if (screen_sync)
+  {
+    size_t n = sizeof(SYNC_BEGIN) - 1;
+    bytebuf_reserve(out, out->len + n + 1);
+    memmove(out->buf + n, out->buf, out->len);
+    memcpy(out->buf, SYNC_BEGIN, n);
+    out->len += n;
+  }
+
+  global.last_x = -1;
+  global.last_y = -1;
+
+  for (int y = 0; y < global.front.height; y++)
+  {
+    for (int x = 0; x < global.front.width;)
+    {
+      struct tb_cell *back = &global.back.cells[y * global.back.width + x];
+      struct tb_cell *front = &global.front.cells[y * global.front.width + x];
+      int w = tb_wcwidth(back->ch);
+      if (w < 1) w = 1;
+
+      if (cell_cmp(back, front) != 0)
+      {
+        cell_copy(front, back);
+        send_attr(back->fg, back->bg);
+
+        if (w > 1 && x >= global.front.width - (w - 1))
+        {
+          /* No room for a wide character at the edge. */
+          for (int i = x; i < global.front.width; i++) send_char(i, y, ' ');
+        }
+        else
+        {
+          send_char(x, y, back->ch);
+
+          /* The cells it covers can't match anything, so they're sent again once it's gone. */
+          uint32_t invalid = -1;
+          for (int i = 1; i < w; i++) cell_set(front + i, &invalid, 1, -1, -1);
+        }
+      }
+      x += w;
+    }
+  }
+
+  send_cursor_if(global.cursor_x, global.cursor_y);
+  if (screen_sync) tb_send(SYNC_END, sizeof(SYNC_END) - 1);
+
+  stats.tty_bytes += out->len;
+  for (size_t done = 0; done < out->len;)
+  {
+    ssize_t n = write(global.wfd, out->buf + done, out->len - done);
+    stats.tty_writes++;
+
+    if (n < 0 && errno != EINTR) break;
+    if (n > 0) done += n;
+  }
+  out->len = 0;
+  stats.frames++;
+}
+
+/* Moves lines `top` to `bot` of `buf` by `n` (up if negative); lines moved in are blank. */
+void
+screen_shift_cells(struct cellbuf_t *buf, int top, int bot, int n)
+{
+  uint32_t space = ' ';
+  int w = buf->width;
+  struct tb_cell line[w];
+
+  for (; n; n += (n < 0) ? 1 : -1)
+  {
+    /* Rotate by one, so every cell keeps its own grapheme buffer, then blank the line rotated in. */
+    int from = (n < 0) ? top : bot;
+    int to = (n < 0) ? bot : top;
+
+    memcpy(line, &buf->cells[from * w], sizeof(line));
+    if (n < 0) memmove(&buf->cells[top * w], &buf->cells[(top + 1) * w], (bot - top) * sizeof(line));
+    else memmove(&buf->cells[(top + 1) * w], &buf->cells[top * w], (bot - top) * sizeof(line));
+    memcpy(&buf->cells[to * w], line, sizeof(line));
+
+    for (int x = 0; x < w; x++) cell_set(&buf->cells[to * w + x], &space, 1, global.fg, global.bg);
+  }
+}
+
+/*
+ * Scrolls screen lines `top` to `bot` by `n` (up if negative) on the terminal itself,
+ * and shifts termbox's buffers to match: the front one, so it knows what the terminal
+ * shows, and the back one, so rows that merely moved don't have to be drawn again.
+ */
+void
+screen_scroll(int top, int bot, int n)
+{
+  /* Lines scrolled in take the current background, make it the default. */
+  tb_sendf("\x1b[m\x1b[%d;%dr\x1b[%d;1H", top + 1, bot + 1, (n < 0 ? bot : top) + 1);
+  for (int i = 0; i < abs(n); i++) tb_send(n < 0 ? "\x1b" "D" : "\x1b" "M", 2);
+  tb_send("\x1b[r", 3);
+  global.last_fg = ~global.fg;
+  global.last_bg = ~global.bg;
+
+  screen_shift_cells(&global.front, top, bot, n);
+  screen_shift_cells(&global.back, top, bot, n);
+  stats.scrolls++;
+}
+
+/*
+ * Decodes the character at byte `j` of a label, returning its length in bytes, and
+ * in `w` how many columns it takes. Invalid UTF-8 comes out as U+FFFD, one byte at a
+ * time, and control characters as '?', so neither can mess up the terminal.
+ */
+size_t
+screen_decode(const wtf_entry_t *item, size_t j, uint32_t *ch, int *w)
+{
+  const unsigned char *c = (const unsigned char *)item->label + j;
+  size_t left = item->label_sz - j;
+
+  size_t sz = c[0] < 0x80 ? 1 : c[0] < 0xc2 ? 0 : c[0] < 0xe0 ? 2 : c[0] < 0xf0 ? 3 : c[0] < 0xf5 ? 4 : 0;
+  uint32_t cp = sz == 1 ? c[0] : c[0] & (0x7f >> sz);
+  for (size_t k = 1; k < sz; k++)
+  {
+    if (k >= left || (c[k] & 0xc0) != 0x80)
+    {
+      sz = 0;
+      break;
+    }
+    cp = (cp << 6) | (c[k] & 0x3f);
+  }
+
+  /* Overlong, surrogate or out of range. */
+  if (sz == 0 || (sz == 3 && (cp < 0x800 || (cp >= 0xd800 && cp < 0xe000))) || (sz == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+  {
+    *ch = 0xfffd;
+    *w = 1;
+    return 1;
+  }
+
+  *ch = cp;
+  *w = tb_wcwidth(cp);
+  if (*w < 0)
+  {
+    *ch = '?';
+    *w = 1;
+  }
+  return sz;
+}
+
+/*
+ * Draws a label clipped to the list's width. Decoding stops at the right edge, so
+ * long lines cost what fits on screen. If the last highlighted character would be
+ * past the edge, the label is scrolled left to show it, and ".." marks each cut end.
+ */
+void
+screen_draw_row(int y, const wtf_entry_t *item, const char *query, size_t query_sz, bool selected, bool picked)
+{
+  size_t primary_fg_attr = TB_DEFAULT;
+  int left = SELECTOR_SZ + 1;
+  int width = view.width - left;
+  uint32_t ch;
+  int w;
+
+  screen_blank(y, view.width);
+  if (selected)
+  {
+    tb_print(0, y, SELECTOR_COLOR, TB_DEFAULT, SELECTOR);
+    primary_fg_attr |= TB_BOLD;
+  }
+  if (picked) tb_print(SELECTOR_SZ, y, PICKED_COLOR, TB_DEFAULT, PICKED);
+  if (width <= 0) return;
+
+  /* Next position to highlight, see `wtf_mark_next`. */
+  size_t mark_i = 0;
+  size_t mark_j = 0;
+  ssize_t mark = wtf_mark_next(item, query, query_sz, &mark_i, &mark_j);
+
+  /* Columns to skip to see the last highlighted character, leaving room for the "..". */
+  int skip = 0;
+  if (mark >= 0 && width > 4)
+  {
+    size_t last_i = mark_i;
+    size_t last_j = mark_j;
+    ssize_t last = mark;
+    for (ssize_t next; (next = wtf_mark_next(item, query, query_sz, &last_i, &last_j)) >= 0;) last = next;
+
+    int end = 0;
+    for (size_t j = 0; j <= (size_t)last; end += w) j += screen_decode(item, j, &ch, &w);
+    if (end > width - 2) skip = end - (width - 2);
+  }
+
+  /* Columns taken so far, and up to where what's drawn is followed by room for "..". */
+  int col = 0;
+  int fits = 0;
+  size_t j = 0;
+  while (j < item->label_sz)
+  {
+    size_t sz = screen_decode(item, j, &ch, &w);
+    if (col + w - skip > width) break;
+
+    size_t fg_attr = primary_fg_attr;
+    for (; mark >= 0 && (size_t)mark < j + sz; mark = wtf_mark_next(item, query, query_sz, &mark_i, &mark_j))
+    {
+      fg_attr |= TB_RED | TB_BOLD;
+    }
+
+    /* Characters behind the leading "..", even partly, are left out. */
+    if (w > 0 && col >= skip + (skip ? 2 : 0)) tb_set_cell(left + col - skip, y, ch, fg_attr, TB_DEFAULT);
+
+    col += w;
+    j += sz;
+    if (col - skip <= width - 2) fits = col - skip;
+  }
+
+  if (skip) tb_print(left, y, primary_fg_attr, TB_DEFAULT, "..");
+  if (j < item->label_sz && width > 4)
+  {
+    for (int x = fits; x < width - 2; x++) tb_set_cell(left + x, y, ' ', TB_DEFAULT, TB_DEFAULT);
+    tb_print(left + width - 2, y, primary_fg_attr, TB_DEFAULT, "..");
+  }
+}
+
+/*
+ * Draws a preview on the right of the list's `lines` lines, one line of text on each.
+ * Text is clipped like rows are, tabs are expanded and escape sequences (colors,
+ * mostly) left out.
+ */
+void
+screen_draw_preview(const char *text, size_t sz, int lines)
+{
+  int left = view.width + 2; /* Past the border and a space. */
+  int top = calcy(2) < calcy(1 + lines) ? calcy(2) : calcy(1 + lines);
+  wtf_entry_t line = { .label = text };
+  uint32_t ch;
+  int w;
+
+  for (int k = 0; k < lines; k++)
+  {
+    int y = top + k;
+    for (int x = view.width; x < tb_width(); x++) tb_set_cell(x, y, ' ', TB_DEFAULT, TB_DEFAULT);
+    tb_print(view.width, y, PREVIEW_BORDER_COLOR, TB_DEFAULT, PREVIEW_BORDER);
+    if (!text || line.label >= text + sz) continue;
+
+    const char *end = memchr(line.label, '\n', text + sz - line.label);
+    line.label_sz = (end ? end : text + sz) - line.label;
+
+    int col = 0;
+    for (size_t j = 0; j < line.label_sz;)
+    {
+      if (line.label[j] == '\x1b')
+      {
+        /* CSI: parameters and intermediates up to a final byte in @..~. Otherwise a single character follows. */
+        j++;
+        if (j < line.label_sz && line.label[j++] == '[')
+          while (j < line.label_sz && (line.label[j] < '@' || line.label[j] > '~')) j++;
+        j++;
+        continue;
+      }
+      if (line.label[j] == '\t' || line.label[j] == '\r')
+      {
+        if (line.label[j++] == '\t') col = (col / 8 + 1) * 8;
+        continue;
+      }
+
+      j += screen_decode(&line, j, &ch, &w);
+      if (left + col + w > tb_width()) break;
+      if (w > 0) tb_set_cell(left + col, y, ch, TB_DEFAULT, TB_DEFAULT);
+      col += w;
+    }
+
+    line.label += line.label_sz + 1;
+  }
+}
+
+/*
+ * Brings the back buffer up to date with the query, `shown` and the selection, drawing
+ * only the regions that changed. Returns whether any did, i.e. there's a frame to present.
+ */
+bool
+screen_draw(wtf_screen_t *scr, wtf_ranker_t *ranker, const wtf_snapshot_t *shown,
+            const char *query, size_t query_sz, size_t cursor,
+            size_t selected, size_t scroll, size_t max_visible,
+            wtf_preview_t *preview, const wtf_selection_t *picks)
+{
+  bool stale = scr->stale;
+  bool drawn = stale;
+  scr->stale = false;
+  if (stale) tb_clear();
+
+  /* Print query and set the cursor at the end of it. */
+  if (!screen_same(&scr->query, query, query_sz) || scr->cursor != cursor || stale)
+  {
+    scr->cursor = cursor;
+    screen_blank(calcy(0), tb_width());
+    tb_print(0, calcy(0), QUERY_PREFIX_COLOR, TB_DEFAULT, QUERY_PREFIX);
+    tb_printf(QUERY_PREFIX_SZ + 1, calcy(0), TB_DEFAULT, TB_DEFAULT, "%.*s", (int)query_sz, query);
+    tb_set_cursor(QUERY_PREFIX_SZ + 1 + cursor, calcy(0));
+    drawn = true;
+  }
+
+  /*
+   * Draw the status bar:
+   * - L/A (P) ---------------------------------------
+   * Where:
+   *   L -> number of listed entries
+   *   A -> number of all entries
+   *   P -> number of picked entries, if any (`--multi`)
+   * While ranking is still underway, A is abbreviated and followed by how much of
+   * it has been gone through so far.
+   */
+  int percent = !shown->partial ? -1 : shown->total ? (int)(100 * shown->done / shown->total) : 100;
+  size_t picked = picks ? picks->count : 0;
+  if (scr->matched != shown->matched || scr->total != shown->total || scr->percent != percent || scr->picked != picked || stale)
+  {
+    size_t w = 0;
+    scr->matched = shown->matched;
+    scr->total = shown->total;
+    scr->percent = percent;
+    scr->picked = picked;
+
+    screen_blank(calcy(1), tb_width());
+    if (shown->partial)
+    {
+      char total[16];
+      format_count(total, sizeof(total), shown->total);
+      tb_printf_ex(0, calcy(1), STATUS_BAR_COLOR, TB_DEFAULT, &w, "%s %zu/%s %d%%", STATUS_BAR_FILL, shown->matched, total, percent);
+    }
+    else
+    {
+      tb_printf_ex(0, calcy(1), STATUS_BAR_COLOR, TB_DEFAULT, &w, "%s %zu/%zu", STATUS_BAR_FILL, shown->matched, shown->total);
+    }
+    if (picked)
+    {
+      size_t more = 0;
+      tb_printf_ex(w, calcy(1), STATUS_BAR_COLOR, TB_DEFAULT, &more, " (%zu)", picked);
+      w += more;
+    }
+
+    const size_t remaining_dashes = tb_width();
+    for (size_t i = (w + 1); i < remaining_dashes; i += STATUS_BAR_FILL_SZ)
+      tb_print(i, calcy(1), STATUS_BAR_COLOR, TB_DEFAULT, STATUS_BAR_FILL);
+    drawn = true;
+  }
+
+  /* Draw the filtered list, highlighted for the query it was ranked for. */
+  if (!screen_same(&scr->marked, shown->query, cvector_size(shown->query))) stale = true;
+
+  size_t listed = cvector_size(shown->matches);
+  if (cvector_size(scr->rows) != max_visible)
+  {
+    cvector_reserve(scr->rows, max_visible ? max_visible : 1);
+    cvector_set_size(scr->rows, max_visible);
+    stale = true;
+  }
+
+  /*
+   * Scrolled by less than a screenful: what's still visible only has to move.
+   * Not with previews, the terminal would scroll them along.
+   */
+  long moved = (long)scroll - (long)scr->scroll;
+  if (!stale && !preview && moved && labs(moved) < (long)max_visible)
+  {
+    int top = calcy(2), bot = calcy(2 + max_visible - 1);
+    int step = calcy(3) - calcy(2); /* Which way the list grows on screen. */
+    if (top > bot)
+    {
+      int y = top;
+      top = bot;
+      bot = y;
+    }
+    screen_scroll(top, bot, -moved * step);
+
+    size_t keep = max_visible - labs(moved);
+    if (moved > 0) memmove(scr->rows, scr->rows + moved, keep * sizeof(wtf_row_t));
+    else memmove(scr->rows - moved, scr->rows, keep * sizeof(wtf_row_t));
+    for (size_t i = 0; i < (size_t)labs(moved); i++)
+      scr->rows[moved > 0 ? keep + i : i] = (wtf_row_t){ .index = SIZE_MAX };
+    drawn = true;
+  }
+  scr->scroll = scroll;
+
+  for (size_t i = 0; i < max_visible; i++)
+  {
+    size_t real_idx = scroll + i;
+    wtf_row_t row = { .index = SIZE_MAX };
+    if (real_idx < listed)
+    {
+      row.index = ranker->index_of(ranker, shown, shown->matches[real_idx].entry);
+      row.selected = real_idx == selected;
+      row.picked = picks && selection_has(picks, row.index);
+    }
+
+    if (!stale && scr->rows[i].index == row.index && scr->rows[i].selected == row.selected && scr->rows[i].picked == row.picked)
+      continue;
+    scr->rows[i] = row;
+    drawn = true;
+    stats.rows_drawn++;
+
+    if (row.index == SIZE_MAX) screen_blank(calcy(2 + i), view.width);
+    else screen_draw_row(calcy(2 + i), shown->matches[real_idx].entry, shown->query, cvector_size(shown->query), row.selected, row.picked);
+  }
+
+  if (preview)
+  {
+    size_t sz;
+    const char *text = preview_text(preview, &sz);
+    if (stale || scr->preview != text || scr->preview_sz != sz)
+    {
+      scr->preview = text;
+      scr->preview_sz = sz;
+      screen_draw_preview(text, sz, (int)max_visible);
+      drawn = true;
+    }
+  }
+
+  return drawn;
+}
+
+typedef struct
+{
+  const char *query; /* Initial query, or NULL. */
+  bool select_1;     /* Pick the only match of the initial query without asking. */
+  bool exit_0;       /* Give up right away if the initial query matches nothing. */
+  bool stream;       /* Keep reading STDIN into the corpus while the finder runs. */
+  unsigned fps;      /* Most redraws a second, or 0 for `FINDER_FPS`. */
+  unsigned height;   /* Lines to draw in below the cursor, or 0 for the whole screen. */
+  bool height_percent; /* `height` is a percentage of the terminal's. */
+  const char *preview; /* Command previewing the selected entry, or NULL. */
+  bool multi;        /* Pick any number of entries with Tab, see `wtf_selection_t`. */
+}
+wtf_finder_opts_t;
+
+/* What woke the finder up, see `finder_start`. */
+enum
+{
+  FINDER_TTY,
+  FINDER_MATCHER,
+  FINDER_FRAME,
+  FINDER_INPUT,
+  FINDER_SIGNAL,
+  FINDER_PREVIEW, /* Up to `FINDER_PREVIEW + 2 * PREVIEW_JOBS`, see `preview_handle`. */
+};
+
+/* Watches `fd` for input, tagged with one of the above. */
+bool
+finder_watch(int epfd, int fd, uint32_t tag)
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/*
+ * Runs the interactive finder. The picked entry is printed through `printer`,
+ * once the terminal is restored. Returns false if nothing was picked.
+ *
+ * With `multi`, Tab and Shift-Tab pick (or unpick) the selected entry and move on,
+ * and Ctrl-T every match of the query. Enter then prints all picked entries, in
+ * input order, or the selected one if none were.
+ *
+ * The initial query is ranked before the terminal is touched at all, so when
+ * `select_1` or `exit_0` settle things, no terminal setup happens.
+ *
+ * The finder always shows the latest snapshot the matcher published, which may
+ * lag behind the query being typed. Enter waits for the current query's.
+ *
+ * It sleeps in epoll until something happens: keys or a resize on the terminal, a
+ * snapshot published (the matcher's eventfd), the frame timer, more input on STDIN
+ * (with `stream`), a signal to quit or output from preview commands. Redraws are held
+ * back to one per frame, the timerfd firing when one is due, and only touch what
+ * changed (see RENDERING). The entry to preview is picked along with them, so
+ * scrolling fast starts no more preview commands than there are frames.
+ */
+bool
+finder_start(wtf_ranker_t *ranker, wtf_printer_t *printer, wtf_finder_opts_t *opts)
+{
+  struct tb_event ev;
+
+  wtf_matcher_t matcher;
+
+  /* What's on screen, and the match we print. */
+  wtf_snapshot_t *shown = NULL;
+  wtf_match_t *picked = NULL;
+
+  char *query = NULL;
+  size_t cursor = 0;
+
+  size_t max_visible = 0;
+  size_t selected = 0;
+  size_t scroll = 0;
+
+  /* The last post, and how many matches it asked for. */
+  uint64_t posted = 0;
+  size_t want = FINDER_WANT;
+
+  /* Entries picked with `multi`, and the post whose matches are to be toggled once they're in. */
+  wtf_selection_t picks = { 0 };
+  uint64_t toggle_post = 0;
+  bool print_picks = false;
+
+  bool tb_ready = false;
+  wtf_preview_t preview = { .want = SIZE_MAX };
+  int epfd = -1;
+  int timerfd = -1;
+  int sigfd = -1;
+
+  /* Whether the screen may be behind, when it was last drawn, and whether a frame is scheduled. */
+  wtf_screen_t screen = { .stale = true };
+  bool dirty = true;
+  double drawn_at = 0;
+  bool frame_armed = false;
+  bool typed_ahead = false;
+  double input_at = 0; /* When streamed input last came in, 0 before the first byte. */
+  double frame_secs = 1.0 / (opts->fps ? opts->fps : FINDER_FPS);
+
+  /* Blocked before the matcher starts, so its thread never takes them either. */
+  sigset_t quit_signals, old_signals;
+  sigemptyset(&quit_signals);
+  sigaddset(&quit_signals, SIGINT);
+  sigaddset(&quit_signals, SIGTERM);
+  sigaddset(&quit_signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &quit_signals, &old_signals);
+
+  if (!matcher_start(&matcher, ranker))
+  {
+    fprintf(stderr, "wtf: starting the matcher failed\n");
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    return false;
+  }
+
+  cvector_init(query, 32, NULL);
+
+  if (opts->query)
+    for (const char *c = opts->query; *c; c++) cvector_push_back(query, *c);
+  cursor = cvector_size(query);
+
+  posted = matcher_post(&matcher, query, cvector_size(query), want);
+  matcher_take(&matcher, &shown, posted);
+
+  if (opts->exit_0 && cvector_size(shown->matches) == 0) goto start_finder_cleanup;
+  if (opts->select_1 && cvector_size(shown->matches) == 1)
+  {
+    picked = &shown->matches[0];
+    goto start_finder_cleanup;
+  }
+
+  {
+    int tb_status = opts->height ? view_init_inline(opts->height, opts->height_percent) : tb_init();
+    if (tb_status)
+    {
+      fprintf(stderr, "initializing termbox failed with code %d\n", tb_status);
+      goto start_finder_cleanup;
+    }
+    tb_ready = true;
+  }
+
+  tb_set_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
+  view.split = opts->preview != NULL;
+  view_resize(opts->height, opts->height_percent);
+  tb_set_cursor(0, calcy(0));
+  tb_set_func(TB_FUNC_EXTRACT_PRE, screen_sync_reply);
+  tb_send(SYNC_QUERY, sizeof(SYNC_QUERY) - 1);
+
+  max_visible = view.height - 2;
+  /* Keys typed while asking where the cursor was are already buffered (see `view_cursor_line`). */
+  typed_ahead = global.in.len > 0;
+
+  {
+    int ttyfd, resizefd;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    sigfd = signalfd(-1, &quit_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (epfd < 0 || timerfd < 0 || sigfd < 0
+        || tb_get_fds(&ttyfd, &resizefd) != TB_OK
+        || !finder_watch(epfd, ttyfd, FINDER_TTY)
+        || !finder_watch(epfd, resizefd, FINDER_TTY)
+        || !finder_watch(epfd, matcher.notify, FINDER_MATCHER)
+        || !finder_watch(epfd, timerfd, FINDER_FRAME)
+        || !finder_watch(epfd, sigfd, FINDER_SIGNAL))
+    {
+      tb_shutdown();
+      tb_ready = false;
+      fprintf(stderr, "wtf: setting up the event loop failed: %s\n", strerror(errno));
+      goto start_finder_cleanup;
+    }
+
+    if (opts->preview) preview_init(&preview, opts->preview, epfd, FINDER_PREVIEW, &old_signals);
+    if (opts->stream)
+    {
+      fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+      if (!finder_watch(epfd, STDIN_FILENO, FINDER_INPUT)) matcher_feed(&matcher, NULL, 0);
+    }
+  }
+
+  do
+  {
+    /*
+     * DRAWING
+     *
+     * At most once per frame; changes coming in sooner are drawn together with the next one.
+     */
+    double now = now_secs();
+    double next_frame = drawn_at + frame_secs;
+    if (dirty && now < next_frame && !frame_armed)
+    {
+      long ns = (next_frame - now) * 1e9 + 1;
+      struct itimerspec due = { .it_value = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 } };
+      timerfd_settime(timerfd, 0, &due, NULL);
+      frame_armed = true;
+    }
+    else if (dirty && now >= next_frame)
+    {
+      dirty = false;
+      if (opts->preview)
+      {
+        bool any = selected < cvector_size(shown->matches);
+        const wtf_entry_t *entry = any ? shown->matches[selected].entry : NULL;
+        preview_select(&preview, any ? ranker->index_of(ranker, shown, entry) : SIZE_MAX, entry);
+      }
+      if (screen_draw(&screen, ranker, shown, query, cvector_size(query), cursor, selected, scroll, max_visible,
+                      opts->preview ? &preview : NULL, opts->multi ? &picks : NULL))
+      {
+        screen_present();
+        drawn_at = now;
+      }
+    }
+
+    /*
+     * EVENT LOGIC
+     */
+    /* One more than asked for, to make room for input read ahead of time. */
+    struct epoll_event events[8 + 1];
+    int n = epoll_wait(epfd, events, 8, typed_ahead ? 0 : -1);
+    if (n < 0 && errno != EINTR) goto start_finder_cleanup;
+    if (typed_ahead && n >= 0)
+    {
+      events[n++].data.u32 = FINDER_TTY;
+      typed_ahead = false;
+    }
+
+    for (int e = 0; e < n; e++)
+    {
+      switch (events[e].data.u32)
+      {
+        case FINDER_MATCHER:
+        {
+          eventfd_t ignore;
+          eventfd_read(matcher.notify, &ignore);
+          if (!matcher_take(&matcher, &shown, 0)) break;
+          dirty = true;
+
+          if (toggle_post && shown->seq == toggle_post && !shown->partial)
+          {
+            selection_toggle_listed(&picks, ranker, shown);
+            toggle_post = 0;
+          }
+
+          size_t listed = cvector_size(shown->matches);
+          if (listed == 0)
+          {
+            /* Go to the beginning if we get no matches and then we get matches again instead of going at the end of the list. */
+            selected = 0;
+            scroll = 0;
+          }
+          else
+          {
+            /*
+             * Reset scroll and select the last visible item if the list shrank below the selector.
+             * Then, just adjust scroll again to fix selector going out of sight.
+             */
+            if (selected >= listed)
+            {
+              selected = listed - 1;
+              scroll = 0;
+            }
+            scroll_to_fit(&scroll, selected, max_visible);
+          }
+          break;
+        }
+
+        case FINDER_FRAME:
+        {
+          uint64_t ignore;
+          if (read(timerfd, &ignore, sizeof(ignore)) < 0 && errno != EAGAIN) goto start_finder_cleanup;
+          frame_armed = false;
+          break;
+        }
+
+        case FINDER_INPUT:
+        {
+          char buf[1 << 16];
+          ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+          if (got >= 0)
+          {
+            /* The library only sees the bytes, so its reads and time, first byte to EOF, are counted here. */
+            double now = now_secs();
+            if (input_at) wtf_stats.ingest_secs += now - input_at;
+            input_at = now;
+            wtf_stats.ingest_reads++;
+          }
+
+          if (got > 0) matcher_feed(&matcher, buf, got);
+          else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+          {
+            matcher_feed(&matcher, NULL, 0);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+          }
+          break;
+        }
+
+        case FINDER_SIGNAL:
+          /* Left pending: it takes effect once the terminal is restored and it's unblocked. */
+          goto start_finder_cleanup;
+
+        default:
+          if (preview_handle(&preview, events[e].data.u32)) dirty = true;
+          break;
+
+        case FINDER_TTY:
+          /* Keys come in bursts (pastes, escape sequences), take them all. */
+          while (tb_peek_event(&ev, 0) == TB_OK)
+          {
+            size_t listed = cvector_size(shown->matches);
+            dirty = true;
+
+            if (ev.type == TB_EVENT_RESIZE)
+            {
+              view_resize(opts->height, opts->height_percent);
+              max_visible = view.height - 2;
+              scroll = 0; /* Reset scroll after resizing. */
+              scroll_to_fit(&scroll, selected, max_visible);
+              screen.stale = true;
+            }
+
+            if (ev.key == TB_KEY_ESC) goto start_finder_cleanup;
+            if (ev.type == TB_EVENT_KEY)
+            {
+              bool query_update = false;
+
+              switch (ev.key)
+              {
+                case 0:
+                  cvector_insert(query, cursor, ev.ch);
+                  cursor++;
+                  query_update = true;
+                  break;
+
+                case TB_KEY_BACKSPACE:
+                case TB_KEY_BACKSPACE2:
+                  if (cvector_size(query) > 0 && cursor > 0)
+                  {
+                    cursor--;
+                    cvector_erase(query, cursor);
+                    query_update = true;
+                  }
+                  break;
+
+                case TB_KEY_ARROW_LEFT:
+                  cursor -= (cursor ? 1 : 0);
+                  break;
+
+                case TB_KEY_ARROW_RIGHT:
+                  cursor += ((cursor < cvector_size(query)) ? 1 : 0);
+                  break;
+
+                case TB_KEY_CTRL_A:
+                  cursor = 0;
+                  break;
+
+                case TB_KEY_CTRL_E:
+                  cursor = cvector_size(query);
+                  break;
+
+                case TB_KEY_ARROW_UP:
+                  if (listed)
+                  {
+
+#ifdef DIRECTION_TOP
+                    if (selected > 0) selected--;
+                    else selected = listed - 1;
+#else /* DIRECTION_TOP */
+                    selected = (selected + 1) % listed;
+#endif /* DIRECTION_TOP */
+
+                    scroll_to_fit(&scroll, selected, max_visible);
+                  }
+                  break;
+
+                case TB_KEY_ARROW_DOWN:
+                  if (listed)
+                  {
+
+#ifdef DIRECTION_TOP
+                    selected = (selected + 1) % listed;
+#else /* DIRECTION_TOP */
+                    if (selected > 0) selected--;
+                    else selected = listed - 1;
+#endif /* DIRECTION_TOP */
+
+                    scroll_to_fit(&scroll, selected, max_visible);
+                  }
+                  break;
+
+                case TB_KEY_TAB:
+                case TB_KEY_BACK_TAB:
+                  if (opts->multi && listed)
+                  {
+                    selection_toggle(&picks, ranker->index_of(ranker, shown, shown->matches[selected].entry));
+
+                    /* On to the next match, or back to the previous one, without wrapping around. */
+                    if (ev.key == TB_KEY_TAB && selected + 1 < listed) selected++;
+                    if (ev.key == TB_KEY_BACK_TAB && selected > 0) selected--;
+                    scroll_to_fit(&scroll, selected, max_visible);
+                  }
+                  break;
+
+                case TB_KEY_CTRL_T:
+                  if (!opts->multi) break;
+                  if (shown->seq == posted && !shown->partial && cvector_size(query) == 0)
+                  {
+                    /* Everything matches, no need to look at the matches at all. */
+                    selection_toggle_all(&picks, shown->total);
+                  }
+                  else if (shown->seq == posted && !shown->partial && listed == shown->matched)
+                  {
+                    selection_toggle_listed(&picks, ranker, shown);
+                  }
+                  else
+                  {
+                    /* Not all of them ranked yet: ask for every one (a `want` of 0), toggled once they're in. */
+                    want = 0;
+                    posted = matcher_post(&matcher, query, cvector_size(query), want);
+                    toggle_post = posted;
+                  }
+                  break;
+
+                case TB_KEY_ENTER:
+                  /* Pick from what the query typed so far matches, not from a stale snapshot. */
+                  matcher_take(&matcher, &shown, posted);
+                  if (toggle_post == shown->seq)
+                  {
+                    selection_toggle_listed(&picks, ranker, shown);
+                    toggle_post = 0;
+                  }
+                  if (picks.count)
+                  {
+                    print_picks = true;
+                    goto start_finder_cleanup;
+                  }
+                  if (selected >= cvector_size(shown->matches)) selected = 0;
+                  picked = (cvector_size(shown->matches) > 0) ? &shown->matches[selected] : NULL;
+                  goto start_finder_cleanup;
+              }
+
+              if (query_update)
+              {
+                /* An empty query lists all entries. */
+                want = FINDER_WANT;
+                toggle_post = 0;
+                posted = matcher_post(&matcher, query, cvector_size(query), want);
+                stats.keystrokes++;
+              }
+              else if (shown->seq == posted && !shown->partial && selected + max_visible >= listed && listed < shown->matched)
+              {
+                /* Scrolled close to the end of what was ranked, ask for more. */
+                want = 2 * (selected + max_visible);
+                posted = matcher_post(&matcher, query, cvector_size(query), want);
+              }
+            }
+          }
+          break;
+      }
+    }
+  }
+  while (true);
+
+start_finder_cleanup:
+    if (tb_ready)
+    {
+      view_leave();
+      tb_shutdown();
+    }
+    preview_free(&preview);
+    if (epfd >= 0) close(epfd);
+    if (timerfd >= 0) close(timerfd);
+    if (sigfd >= 0) close(sigfd);
+
+    if (picked)
+    {
+      print_match(printer, ranker->index_of(ranker, shown, picked->entry), picked, shown->query, cvector_size(shown->query));
+      out_flush(&printer->out);
+    }
+
+    matcher_stop(&matcher);
+    if (print_picks) selection_print(&picks, ranker, printer, shown->query, cvector_size(shown->query));
+
+    snapshot_free(shown);
+    cvector_free(picks.bits);
+    cvector_free(query);
+    screen_free(&screen);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    return picked != NULL || print_picks;
+}
+
+/*
+ * Reads one input file (or STDIN for "-") and tells what went wrong, if anything.
+ * With `follow`, regular files are left open and their descriptors pushed onto it.
+ */
+bool
+read_path(wtf_corpus_t *corpus, const char *path, cvector(int) *follow)
+{
+  int fd = -1;
+  bool ok = wtf_corpus_read_path(corpus, path, follow ? &fd : NULL);
+
+  if (!ok) fprintf(stderr, "wtf: %s: %s\n", strcmp(path, "-") == 0 ? "STDIN" : path, strerror(errno));
+  if (fd >= 0) cvector_push_back(*follow, fd);
+
+  return ok;
+}
+
+/*
+ * Non-interactive mode: rank the whole list against `query` once and print the matches,
+ * best first, without ever touching the terminal.
+ *
+ * Returns the number of printed entries.
+ */
+size_t
+filter_run(wtf_corpus_t *corpus, char *query, size_t limit, wtf_printer_t *printer)
+{
+  size_t list_sz;
+  const wtf_entry_t *list = wtf_corpus_entries(corpus, &list_sz);
+  size_t query_sz = strlen(query);
+  size_t cap = list_sz;
+  if (limit && limit < cap) cap = limit;
+
+  wtf_match_t *ranked = NULL;
+  wtf_ctx_t *ctx = wtf_ctx_new(FUZZ_MAX_INACCURACY);
+
+  cvector_init(ranked, cap ? cap : 1, NULL);
+
+  size_t n = wtf_corpus_rank(ctx, corpus, query, query_sz, limit, ranked, NULL);
+  cvector_set_size(ranked, n);
+
+  for (size_t i = 0; i < n; i++)
+    print_match(printer, ranked[i].entry - list, &ranked[i], query, query_sz);
+  out_flush(&printer->out);
+
+  wtf_ctx_free(ctx);
+  cvector_free(ranked);
+
+  return n;
+}
+
+/*
+ * Batch mode: every line of a queries file is ranked against the same corpus.
+ *
+ * Workers claim queries one at a time from a shared counter and rank them with their own
+ * query context, into their own slice of `results`. The corpus is only ever read.
+ */
+typedef struct
+{
+  wtf_corpus_t *corpus;
+  const wtf_entry_t *queries;
+  size_t nqueries;
+  size_t limit;
+  size_t next;          /* Next query to claim. */
+  wtf_match_t *results; /* `limit` slots for each query. */
+  size_t *counts;       /* How many of them are used. */
+}
+wtf_batch_t;
+
+void*
+batch_worker(void *arg)
+{
+  wtf_batch_t *batch = arg;
+  wtf_ctx_t *ctx = wtf_ctx_new(FUZZ_MAX_INACCURACY);
+
+  for (;;)
+  {
+    size_t q = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (q >= batch->nqueries) break;
+
+    const wtf_entry_t *query = &batch->queries[q];
+    batch->counts[q] = wtf_corpus_rank(
+      ctx,
+      batch->corpus,
+      query->label,
+      query->label_sz,
+      batch->limit,
+      &batch->results[q * batch->limit],
+      NULL
+    );
+  }
+
+  wtf_ctx_free(ctx);
+
+  return NULL;
+}
+
+/*
+ * Answers every query in `queries`, in parallel, and prints the results in query order.
+ *
+ * TSV:   query <TAB> rank <TAB> distance <TAB> label
+ * JSONL: {"query":"...","results":[...]}, results as in `wtf_printer_t`
+ */
+bool
+batch_run(wtf_corpus_t *corpus, wtf_corpus_t *queries_corpus, size_t limit, wtf_printer_t *printer)
+{
+  size_t list_sz, nqueries;
+  const wtf_entry_t *list = wtf_corpus_entries(corpus, &list_sz);
+  const wtf_entry_t *queries = wtf_corpus_entries(queries_corpus, &nqueries);
+  double start = now_secs();
+
+  wtf_batch_t batch = {
+    .corpus = corpus,
+    .queries = queries,
+    .nqueries = nqueries,
+    .limit = limit,
+    .results = wtf_malloc(nqueries * limit * sizeof(wtf_match_t) + 1),
+    .counts = wtf_calloc(nqueries + 1, sizeof(size_t)),
+  };
+
+  if (!batch.results || !batch.counts)
+  {
+    fprintf(stderr, "wtf: could not allocate room for %zu results\n", nqueries * limit);
+    wtf_free(batch.results);
+    wtf_free(batch.counts);
+    return false;
+  }
+
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) nthreads = 1;
+  if ((size_t)nthreads > nqueries) nthreads = nqueries;
+
+  pthread_t threads[nthreads ? nthreads : 1];
+  long started = 0;
+
+  /* The calling thread works too; if a worker can't be started, the rest just do more. */
+  for (; started + 1 < nthreads; started++)
+    if (pthread_create(&threads[started], NULL, batch_worker, &batch)) break;
+  batch_worker(&batch);
+  for (long i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  stats.queries += nqueries;
+  stats.query_secs += now_secs() - start;
+
+  wtf_out_t *out = &printer->out;
+  bool jsonl = printer->format == OUTPUT_JSONL;
+
+  for (size_t q = 0; q < nqueries; q++)
+  {
+    const wtf_entry_t *query = &queries[q];
+    wtf_match_t *results = &batch.results[q * limit];
+
+    if (jsonl)
+    {
+      out_str(out, "{\"query\":");
+      out_json_str(out, query->label, query->label_sz);
+      out_str(out, ",\"results\":[");
+    }
+
+    for (size_t i = 0; i < batch.counts[q]; i++)
+    {
+      const wtf_entry_t *entry = results[i].entry;
+
+      if (jsonl)
+      {
+        if (i) out_char(out, ',');
+        out_match_json(out, entry - list, &results[i], query->label, query->label_sz);
+      }
+      else
+      {
+        out_bytes(out, query->label, query->label_sz);
+        out_char(out, '\t');
+        out_int(out, i + 1);
+        out_char(out, '\t');
+        out_int(out, results[i].distance);
+        out_char(out, '\t');
+        out_bytes(out, entry->label, entry->label_sz);
+        out_char(out, '\n');
+      }
+    }
+
+    if (jsonl) out_str(out, "]}\n");
+  }
+  out_flush(out);
+
+  wtf_free(batch.results);
+  wtf_free(batch.counts);
+
+  return true;
+}
+
+/*
+ * DAEMON
+ *
+ * `--daemon` keeps the corpus in memory and answers queries over a Unix socket,
+ * `--connect` runs the finder against such a daemon instead of reading any input.
+ *
+ * Every request is one line, answered with a header line and a body of `size` bytes:
+ *
+ *   Q <want> <query>\n                                         (`want` 0 for all)
+ *   R <matched> <total> <count> <size>\n
+ *   <index> <distance> <inaccuracy> <label length> <label>\n   (`count` times)
+ *
+ * Each request carries the whole query, so keystrokes need no state on the daemon.
+ */
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_WANT ((size_t)1 << 20)
+/* Clients sending longer lines are dropped. */
+#define DAEMON_MAX_REQUEST 8192
+
+typedef struct
+{
+  int fd;
+  cvector(char) in;  /* Bytes of requests not answered yet. */
+  cvector(char) out; /* The answer being sent, */
+  size_t sent;       /* and how much of it went out so far. */
+}
+wtf_client_t;
+
+volatile sig_atomic_t daemon_quit = 0;
+
+void
+daemon_on_signal(int sig)
+{
+  (void)sig;
+  daemon_quit = 1;
+}
+
+/*
+ * Picks up whatever got appended to the followed input files since they were last read.
+ */
+void
+daemon_refresh(wtf_corpus_t *corpus, cvector(int) follow)
+{
+  for (size_t i = 0; i < cvector_size(follow); i++)
+  {
+    struct stat st;
+    off_t pos = lseek(follow[i], 0, SEEK_CUR);
+
+    if (pos >= 0 && fstat(follow[i], &st) == 0 && st.st_size > pos
+        && !wtf_corpus_read_fd(corpus, follow[i]))
+      fprintf(stderr, "wtf: reading input failed: %s\n", strerror(errno));
+  }
+}
+
+/* Writes all of `iov`, however many calls it takes; it's advanced past what got written. */
+bool
+writev_full(int fd, struct iovec *iov, int iov_cnt)
+{
+  while (iov_cnt > 0)
+  {
+    ssize_t n = writev(fd, iov, iov_cnt);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+
+    for (; iov_cnt > 0 && (size_t)n >= iov->iov_len; iov++, iov_cnt--) n -= iov->iov_len;
+    if (iov_cnt > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/* Appends the answer to `req` to `out`. Malformed requests go unanswered. */
+void
+daemon_answer(wtf_corpus_t *corpus, char *req, size_t req_sz, cvector(wtf_match_t) *ranked, cvector(char) *body, cvector(char) *out, wtf_ctx_t *ctx)
+{
+  char *end = NULL;
+  if (req_sz < 2 || req[0] != 'Q' || req[1] != ' ') return;
+
+  size_t want = strtoull(req + 2, &end, 10);
+  if (end == req + 2 || *end != ' ') return;
+  /* 0 asks for all of them, as far as the daemon is willing to go. */
+  if (!want || want > DAEMON_MAX_WANT) want = DAEMON_MAX_WANT;
+
+  char *query = end + 1;
+  size_t query_sz = req + req_sz - query;
+
+  size_t list_sz;
+  const wtf_entry_t *list = wtf_corpus_entries(corpus, &list_sz);
+  size_t matched = 0;
+  size_t cap = want < list_sz ? want : list_sz;
+
+  cvector_reserve(*ranked, cap ? cap : 1);
+
+  size_t n = wtf_corpus_rank(ctx, corpus, query, query_sz, want, *ranked, &matched);
+
+  cvector_set_size(*body, 0);
+  for (size_t i = 0; i < n; i++)
+  {
+    wtf_match_t *m = &(*ranked)[i];
+    char head[96];
+    int head_sz = snprintf(
+      head,
+      sizeof(head),
+      "%zu %d %d %zu ",
+      (size_t)(m->entry - list),
+      m->distance,
+      m->inaccuracy,
+      m->entry->label_sz
+    );
+
+    size_t at = cvector_size(*body);
+    size_t grow = head_sz + m->entry->label_sz + 1;
+    if (cvector_capacity(*body) < at + grow) cvector_reserve(*body, 2 * (at + grow));
+    memcpy(*body + at, head, head_sz);
+    memcpy(*body + at + head_sz, m->entry->label, m->entry->label_sz);
+    (*body)[at + grow - 1] = '\n';
+    cvector_set_size(*body, at + grow);
+  }
+
+  char header[128];
+  int header_sz = snprintf(header, sizeof(header), "R %zu %zu %zu %zu\n", matched, list_sz, n, cvector_size(*body));
+
+  size_t at = cvector_size(*out);
+  cvector_reserve(*out, at + header_sz + cvector_size(*body));
+  memcpy(*out + at, header, header_sz);
+  if (cvector_size(*body)) memcpy(*out + at + header_sz, *body, cvector_size(*body));
+  cvector_set_size(*out, at + header_sz + cvector_size(*body));
+
+  stats.requests++;
+}
+
+/* Sends as much of the pending answer as the socket takes. Returns false if the client is gone. */
+bool
+daemon_send(wtf_client_t *c)
+{
+  while (c->sent < cvector_size(c->out))
+  {
+    ssize_t n = write(c->fd, c->out + c->sent, cvector_size(c->out) - c->sent);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) return true;
+    if (n < 0)
+    {
+      if (errno != EPIPE && errno != ECONNRESET)
+        fprintf(stderr, "wtf: answering a client failed: %s\n", strerror(errno));
+      return false;
+    }
+    c->sent += n;
+  }
+
+  cvector_set_size(c->out, 0);
+  c->sent = 0;
+  return true;
+}
+
+/*
+ * Answers the complete requests `c` sent, one at a time: the next only once the last
+ * answer is out, so at most one is ever queued. Returns false if the client is gone.
+ */
+bool
+daemon_serve(wtf_corpus_t *corpus, cvector(int) follow, wtf_client_t *c, cvector(wtf_match_t) *ranked, cvector(char) *body, wtf_ctx_t *ctx)
+{
+  if (!cvector_size(c->in)) return true;
+
+  char *start = c->in;
+  char *end = c->in + cvector_size(c->in);
+  char *nl;
+  bool ok = true;
+  while (ok && !cvector_size(c->out) && (nl = memchr(start, '\n', end - start)))
+  {
+    daemon_refresh(corpus, follow);
+    daemon_answer(corpus, start, nl - start, ranked, body, &c->out, ctx);
+    start = nl + 1;
+    ok = daemon_send(c);
+  }
+  memmove(c->in, start, end - start);
+  cvector_set_size(c->in, end - start);
+
+  if (ok && cvector_size(c->in) > DAEMON_MAX_REQUEST && !memchr(c->in, '\n', cvector_size(c->in)))
+  {
+    fprintf(stderr, "wtf: dropping a client: request longer than %d bytes\n", DAEMON_MAX_REQUEST);
+    ok = false;
+  }
+  return ok;
+}
+
+int
+socket_open(const char *path, struct sockaddr_un *addr)
+{
+  *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "wtf: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) fprintf(stderr, "wtf: socket: %s\n", strerror(errno));
+  return fd;
+}
+
+/*
+ * Serves `corpus` on the socket at `path` until SIGINT or SIGTERM.
+ * Requests are answered one at a time, in the order they come in. Answers go out as
+ * fast as each client reads them, so one that doesn't never holds up the others.
+ */
+bool
+daemon_run(wtf_corpus_t *corpus, cvector(int) follow, const char *path)
+{
+  struct sockaddr_un addr;
+  int lfd = socket_open(path, &addr);
+  if (lfd < 0) return false;
+
+  unlink(path);
+  if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0)
+  {
+    fprintf(stderr, "wtf: %s: %s\n", path, strerror(errno));
+    close(lfd);
+    return false;
+  }
+
+  {
+    struct sigaction sa = { .sa_handler = daemon_on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  wtf_client_t clients[DAEMON_MAX_CLIENTS];
+  struct pollfd pfds[DAEMON_MAX_CLIENTS + 1];
+  size_t nclients = 0;
+
+  wtf_match_t *ranked = NULL;
+  char *body = NULL;
+  wtf_ctx_t *ctx = wtf_ctx_new(FUZZ_MAX_INACCURACY);
+
+  while (!daemon_quit)
+  {
+    pfds[0] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+    for (size_t i = 0; i < nclients; i++)
+      pfds[i + 1] = (struct pollfd){ .fd = clients[i].fd, .events = cvector_size(clients[i].out) ? POLLOUT : POLLIN };
+
+    if (poll(pfds, nclients + 1, -1) < 0)
+    {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "wtf: poll: %s\n", strerror(errno));
+      break;
+    }
+
+    for (size_t i = nclients; i-- > 0;)
+    {
+      if (!pfds[i + 1].revents) continue;
+
+      wtf_client_t *c = &clients[i];
+      bool ok;
+
+      if (cvector_size(c->out))
+      {
+        /* Requests that came in meanwhile are waiting for this answer to be out. */
+        ok = daemon_send(c) && daemon_serve(corpus, follow, c, &ranked, &body, ctx);
+      }
+      else
+      {
+        char buf[4096];
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+        ok = n > 0;
+        if (ok)
+        {
+          size_t at = cvector_size(c->in);
+          cvector_reserve(c->in, at + n);
+          memcpy(c->in + at, buf, n);
+          cvector_set_size(c->in, at + n);
+          ok = daemon_serve(corpus, follow, c, &ranked, &body, ctx);
+        }
+      }
+
+      if (!ok)
+      {
+        close(c->fd);
+        cvector_free(c->in);
+        cvector_free(c->out);
+        clients[i] = clients[--nclients];
+      }
+    }
+
+    if (pfds[0].revents & POLLIN)
+    {
+      int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (cfd >= 0 && nclients < DAEMON_MAX_CLIENTS)
+        clients[nclients++] = (wtf_client_t){ .fd = cfd };
+      else if (cfd >= 0)
+        close(cfd);
+    }
+  }
+
+  for (size_t i = 0; i < nclients; i++)
+  {
+    close(clients[i].fd);
+    cvector_free(clients[i].in);
+    cvector_free(clients[i].out);
+  }
+
+  wtf_ctx_free(ctx);
+  cvector_free(ranked);
+  cvector_free(body);
+
+  close(lfd);
+  unlink(path);
+
+  return true;
+}
+
+/*
+ * The client side: a ranker for the finder that asks the daemon. Entries point into
+ * the response, which is kept in the snapshot it was read for.
+ */
+typedef struct
+{
+  int fd;
+  bool failed; /* Sending a query failed, and was reported. */
+}
+wtf_remote_t;
+
+/* Reads until `buf` holds at least `sz` bytes. They're always followed by a NUL. */
+bool
+remote_fill(wtf_remote_t *remote, cvector(char) *buf, size_t sz)
+{
+  while (cvector_size(*buf) < sz)
+  {
+    size_t at = cvector_size(*buf);
+    cvector_reserve(*buf, (sz > at + 4096 ? sz : at + 4096) + 1);
+
+    ssize_t n = read(remote->fd, *buf + at, cvector_capacity(*buf) - at - 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+
+    cvector_set_size(*buf, at + n);
+    (*buf)[at + n] = '\0';
+  }
+  return true;
+}
+
+/* Parses a decimal number followed by a space. */
+bool
+parse_num(char **p, char *end, long long *out)
+{
+  bool neg = (*p < end && **p == '-');
+  char *c = *p + neg;
+  unsigned long long v = 0;
+
+  if (c >= end || *c < '0' || *c > '9') return false;
+  for (; c < end && *c >= '0' && *c <= '9'; c++) v = v * 10 + (*c - '0');
+  if (c >= end || *c != ' ') return false;
+
+  *out = neg ? -(long long)v : (long long)v;
+  *p = c + 1;
+  return true;
+}
+
+void
+remote_rank(wtf_ranker_t *self, const char *query, size_t query_sz, size_t want, wtf_snapshot_t *snap)
+{
+  wtf_remote_t *remote = self->ctx;
+  char head[32];
+  int head_sz = snprintf(head, sizeof(head), "Q %zu ", want);
+
+  struct iovec iov[3] = {
+    { .iov_base = head, .iov_len = head_sz },
+    { .iov_base = (char*)query, .iov_len = query_sz },
+    { .iov_base = "\n", .iov_len = 1 },
+  };
+
+  cvector_init(snap->buf, 4096, NULL);
+  cvector_set_size(snap->matches, 0);
+  cvector_set_size(snap->entries, 0);
+  cvector_set_size(snap->indices, 0);
+  cvector_set_size(snap->buf, 0);
+  snap->matched = 0;
+
+  if (!writev_full(remote->fd, iov, 3))
+  {
+    if (!remote->failed) fprintf(stderr, "wtf: sending a query to the daemon failed: %s\n", strerror(errno));
+    remote->failed = true;
+    return;
+  }
+
+  /* Header first, it's tiny. */
+  char *nl = NULL;
+  while (!(nl = memchr(snap->buf, '\n', cvector_size(snap->buf))))
+    if (!remote_fill(remote, &snap->buf, cvector_size(snap->buf) + 1)) return;
+
+  size_t matched, total, count, size;
+  if (sscanf(snap->buf, "R %zu %zu %zu %zu", &matched, &total, &count, &size) != 4) return;
+
+  size_t body = nl + 1 - snap->buf;
+  if (!remote_fill(remote, &snap->buf, body + size)) return;
+
+  cvector_reserve(snap->entries, count ? count : 1);
+  cvector_reserve(snap->indices, count ? count : 1);
+  cvector_reserve(snap->matches, count ? count : 1);
+
+  char *p = snap->buf + body;
+  char *end = p + size;
+  for (size_t i = 0; i < count && p < end; i++)
+  {
+    long long index, distance, inaccuracy, label_sz;
+
+    if (!parse_num(&p, end, &index)
+        || !parse_num(&p, end, &distance)
+        || !parse_num(&p, end, &inaccuracy)
+        || !parse_num(&p, end, &label_sz)
+        || label_sz < 0
+        || end - p < label_sz + 1)
+      break;
+
+    char *label = p;
+    label[label_sz] = '\0';
+    p = label + label_sz + 1;
+
+    snap->entries[i] = (wtf_entry_t){ .label = label, .label_sz = label_sz };
+    snap->indices[i] = index;
+    snap->matches[i] = (wtf_match_t){ .distance = distance, .inaccuracy = inaccuracy };
+    cvector_set_size(snap->entries, i + 1);
+    cvector_set_size(snap->indices, i + 1);
+    cvector_set_size(snap->matches, i + 1);
+  }
+
+  /* `entries` doesn't move anymore, point at it. */
+  for (size_t i = 0; i < cvector_size(snap->matches); i++)
+    snap->matches[i].entry = &snap->entries[i];
+
+  snap->matched = matched;
+  snap->total = total;
+}
+
+size_t
+remote_index_of(wtf_ranker_t *self, const wtf_snapshot_t *snap, const wtf_entry_t *entry)
+{
+  (void)self;
+  return snapshot_index_of(snap, entry);
+}
+
+bool
+remote_connect(wtf_remote_t *remote, const char *path)
+{
+  struct sockaddr_un addr;
+
+  *remote = (wtf_remote_t){ .fd = socket_open(path, &addr) };
+  if (remote->fd < 0) return false;
+
+  if (connect(remote->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    fprintf(stderr, "wtf: %s: %s\n", path, strerror(errno));
+    close(remote->fd);
+    return false;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  return true;
+}
+
+void
+remote_free(wtf_remote_t *remote)
+{
+  close(remote->fd);
+}
+
+void
+print_help(FILE *stream)
+{
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+#define HELP \
+  "Usage: wtf [OPTIONS] [FILE...]\n" \
+  "\n" \
+  "Simple interactive command line fuzzy finder.\n" \
+  "Designed to take any kind of new-line separated list from STDIN,\n" \
+  "or from the given FILEs (\"-\" stands for STDIN).\n" \
+  "\n" \
+  "Options:\n" \
+  "  -h, --help     display this help and exit\n" \
+  "  -f, --filter QUERY\n" \
+  "                 print the entries matching QUERY, best first, and exit\n" \
+  "  -q, --queries FILE\n" \
+  "                 rank the input against every line of FILE, in parallel,\n" \
+  "                 and print the best matches for each of them\n" \
+  "      --limit N  print at most N entries per query (10 by default with --queries)\n" \
+  "      --query QUERY\n" \
+  "                 start the finder with QUERY already typed in\n" \
+  "  -1, --select-1 pick the only match of the initial query without asking\n" \
+  "  -0, --exit-0   exit right away if the initial query matches nothing\n" \
+  "      --fps N    redraw the finder at most N times a second (" STR(FINDER_FPS) " by default)\n" \
+  "      --height N[%%]\n" \
+  "                 draw the finder on N lines (or N%% of the terminal) below the\n" \
+  "                 cursor instead of the whole screen\n" \
+  "  -m, --multi    pick several entries with Tab/Shift-Tab (Ctrl-T: every match)\n" \
+  "                 and print them all, in input order\n" \
+  "      --preview CMD\n" \
+  "                 show what CMD prints for the selected entry beside the list;\n" \
+  "                 {} in CMD is replaced by the entry, quoted for the shell\n" \
+  "      --output=FORMAT\n" \
+  "                 print results as plain labels (default), tsv or jsonl;\n" \
+  "                 tsv and jsonl include indices, distances and (jsonl)\n" \
+  "                 matched byte positions\n" \
+  "      --daemon   keep the input in memory and answer queries on --socket\n" \
+  "      --socket PATH\n" \
+  "                 Unix socket for --daemon; appended input files are picked up\n" \
+  "      --connect PATH\n" \
+  "                 run the finder against the daemon on PATH, reading no input\n" \
+  "      --build-index -o INDEX\n" \
+  "                 write the input to INDEX, ready to be mapped by --index\n" \
+  "      --index INDEX\n" \
+  "                 use a file written by --build-index as (the start of) the input\n" \
+  "      --char-index\n" \
+  "                 index which entries hold which characters, so selective\n" \
+  "                 queries only score the entries holding all of theirs\n" \
+  "      --trigram-index\n" \
+  "                 index which entries hold which trigrams, so exact queries\n" \
+  "                 ('foo) of 3+ characters only check the entries holding all of\n" \
+  "                 theirs; stored in the file by --build-index\n" \
+  "      --read0    read input delimited by ASCII NUL characters\n" \
+  "      --print0   print output delimited by ASCII NUL characters\n" \
+  "      --stats    print memory and timing statistics to STDERR on exit\n" \
+  "\n"
+
+  fprintf(stream, HELP);
+}
+
+void
+print_stats(FILE *stream)
+{
+  fprintf(stream, "wtf: allocations: %zu, frees: %zu\n", wtf_stats.allocs, wtf_stats.frees);
+  fprintf(
+    stream,
+    "wtf: allocations while typing: %zu over %zu keystrokes, %zu after warm-up\n",
+    stats.typing_allocs,
+    stats.keystrokes,
+    stats.warm_allocs
+  );
+  fprintf(stream, "wtf: corpus arena: %zu bytes, scratch arena: %zu bytes\n", wtf_stats.corpus_bytes, wtf_stats.scratch_bytes);
+  if (stats.requests)
+    fprintf(stream, "wtf: daemon requests: %zu\n", stats.requests);
+  if (stats.queries)
+    fprintf(
+      stream,
+      "wtf: queries: %zu in %.3f s (%.1f queries/s)\n",
+      stats.queries,
+      stats.query_secs,
+      stats.query_secs > 0 ? stats.queries / stats.query_secs : 0.0
+    );
+  if (wtf_stats.length_skips)
+    fprintf(stream, "wtf: matches too far off in length to score: %zu\n", wtf_stats.length_skips);
+  if (stats.out_writes)
+    fprintf(stream, "wtf: output: %zu bytes in %zu writes\n", stats.out_bytes, stats.out_writes);
+  if (stats.frames)
+    fprintf(
+      stream,
+      "wtf: frames: %zu, %zu bytes in %zu writes to the terminal, list rows drawn: %zu, scrolled: %zu\n",
+      stats.frames,
+      stats.tty_bytes,
+      stats.tty_writes,
+      stats.rows_drawn,
+      stats.scrolls
+    );
+  if (stats.previews || stats.preview_hits)
+    fprintf(
+      stream,
+      "wtf: previews: %zu commands started, %zu killed, %zu shown from the cache\n",
+      stats.previews,
+      stats.previews_killed,
+      stats.preview_hits
+    );
+  fprintf(
+    stream,
+    "wtf: ingest: %zu bytes in %zu reads (%zu via io_uring), %.3f s (%.1f MiB/s)\n",
+    wtf_stats.ingest_bytes,
+    wtf_stats.ingest_reads,
+    wtf_stats.ingest_uring_reads,
+    wtf_stats.ingest_secs,
+    wtf_stats.ingest_secs > 0 ? wtf_stats.ingest_bytes / wtf_stats.ingest_secs / (1 << 20) : 0.0
+  );
+  if (wtf_stats.postings_bytes)
+    fprintf(
+      stream,
+      "wtf: character index: %zu bytes, built in %.3f s, %zu entries skipped by it\n",
+      wtf_stats.postings_bytes,
+      wtf_stats.postings_secs,
+      wtf_stats.postings_skips
+    );
+  if (wtf_stats.trigram_bytes)
+    fprintf(
+      stream,
+      "wtf: trigram index: %zu bytes, built in %.3f s, %zu queries, %zu entries skipped by it\n",
+      wtf_stats.trigram_bytes,
+      wtf_stats.trigram_secs,
+      wtf_stats.trigram_queries,
+      wtf_stats.trigram_skips
+    );
+  if (wtf_stats.index_bytes)
+    fprintf(
+      stream,
+      "wtf: index: %zu bytes mapped in %.3f s, %zu entries skipped by signature\n",
+      wtf_stats.index_bytes,
+      wtf_stats.index_secs,
+      wtf_stats.signature_skips
+    );
+}
+
+int
+main(int argc, char **argv)
+{
+  bool show_stats = false;
+  char out_delim = '\n';
+  char *filter = NULL;
+  char *queries_path = NULL;
+  size_t limit = 0;
+  wtf_output_t output = OUTPUT_PLAIN;
+  wtf_finder_opts_t finder_opts = {0};
+  bool daemon = false;
+  char *daemon_path = NULL;
+  char *connect_path = NULL;
+  char *index_path = NULL;
+  char *index_out = NULL;
+  bool build_index = false;
+  bool char_index = false;
+  bool trigram_index = false;
+  cvector(int) follow = NULL;
+  cvector(char*) paths = NULL;
+  char in_delim = '\n';
+  wtf_corpus_t *corpus = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--help") == 0
+        || strcmp(argv[i], "-h") == 0)
+    {
       print_help(stdout);
       return 0;
     }
+    else if (strcmp(argv[i], "--stats") == 0)
+    {
+      show_stats = true;
+    }
+    else if ((strcmp(argv[i], "--filter") == 0
+              || strcmp(argv[i], "-f") == 0) && i + 1 < argc)
+    {
+      filter = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--queries") == 0
+              || strcmp(argv[i], "-q") == 0) && i + 1 < argc)
+    {
+      queries_path = argv[++i];
+    }
+    else if (strncmp(argv[i], "--output=", 9) == 0)
+    {
+      if (strcmp(argv[i] + 9, "tsv") == 0) output = OUTPUT_TSV;
+      else if (strcmp(argv[i] + 9, "jsonl") == 0) output = OUTPUT_JSONL;
+      else
+      {
+        fprintf(stderr, "wtf: unknown output format: %s\n", argv[i] + 9);
+        return 2;
+      }
+    }
+    else if (strcmp(argv[i], "--daemon") == 0)
+    {
+      daemon = true;
+    }
+    else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+    {
+      daemon_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+    {
+      connect_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--build-index") == 0)
+    {
+      build_index = true;
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      index_out = argv[++i];
+    }
+    else if (strcmp(argv[i], "--char-index") == 0)
+    {
+      char_index = true;
+    }
+    else if (strcmp(argv[i], "--trigram-index") == 0)
+    {
+      trigram_index = true;
+    }
+    else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc)
+    {
+      index_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc)
+    {
+      finder_opts.query = argv[++i];
+    }
+    else if (strcmp(argv[i], "--select-1") == 0
+             || strcmp(argv[i], "-1") == 0)
+    {
+      finder_opts.select_1 = true;
+    }
+    else if (strcmp(argv[i], "--exit-0") == 0
+             || strcmp(argv[i], "-0") == 0)
+    {
+      finder_opts.exit_0 = true;
+    }
+    else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+    {
+      char *end = NULL;
+      limit = strtoull(argv[++i], &end, 10);
+      if (*end != '\0')
+      {
+        fprintf(stderr, "wtf: invalid limit: %s\n", argv[i]);
+        return 2;
+      }
+    }
+    else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+    {
+      char *end = NULL;
+      unsigned long fps = strtoul(argv[++i], &end, 10);
+      if (*end != '\0' || fps == 0 || fps > 1000)
+      {
+        fprintf(stderr, "wtf: invalid frame rate: %s\n", argv[i]);
+        return 2;
+      }
+      finder_opts.fps = fps;
+    }
+    else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--multi") == 0)
+    {
+      finder_opts.multi = true;
+    }
+    else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+    {
+      finder_opts.preview = argv[++i];
+    }
+    else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+    {
+      char *end = NULL;
+      unsigned long height = strtoul(argv[++i], &end, 10);
+      finder_opts.height_percent = *end == '%';
+      if (finder_opts.height_percent) end++;
+
+      if (*end != '\0' || height == 0 || (finder_opts.height_percent && height > 100) || height > 10000)
+      {
+        fprintf(stderr, "wtf: invalid height: %s\n", argv[i]);
+        return 2;
+      }
+      finder_opts.height = height;
+    }
+    else if (strcmp(argv[i], "--read0") == 0)
+    {
+      in_delim = '\0';
+    }
+    else if (strcmp(argv[i], "--print0") == 0)
+    {
+      out_delim = '\0';
+    }
+    else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)
+    {
+      cvector_push_back(paths, argv[i]);
+    }
     else
     {
       print_help(stderr);
@@ -477,71 +3396,181 @@ main(int argc, char **argv)
     }
   }
 
-  if (isatty(STDIN_FILENO))
+  if (daemon != (daemon_path != NULL))
+  {
+    fprintf(stderr, "wtf: --daemon and --socket go together\n");
+    return 2;
+  }
+
+  static char out_buf[1 << 16];
+  wtf_printer_t printer = {
+    .out = { .fd = STDOUT_FILENO, .buf = out_buf, .cap = sizeof(out_buf) },
+    .format = output,
+    .delim = out_delim,
+  };
+
+  if (connect_path)
+  {
+    if (finder_opts.multi)
+    {
+      fprintf(stderr, "wtf: --multi needs the input in this process, not --connect\n");
+      return 2;
+    }
+
+    wtf_remote_t remote;
+    if (!remote_connect(&remote, connect_path)) return 2;
+
+    wtf_ranker_t ranker = {
+      .rank = remote_rank,
+      .index_of = remote_index_of,
+      .ctx = &remote,
+    };
+
+    bool picked = finder_start(&ranker, &printer, &finder_opts);
+
+    remote_free(&remote);
+    cvector_free(paths);
+    if (show_stats) print_stats(stderr);
+
+    return picked ? 0 : 1;
+  }
+
+  if (build_index != (index_out != NULL))
+  {
+    fprintf(stderr, "wtf: --build-index and -o go together\n");
+    return 2;
+  }
+
+  if (cvector_size(paths) == 0 && !index_path && isatty(STDIN_FILENO))
   {
     fprintf(stderr, "wtf: expected piped input\n");
     return 2;
   }
 
   int err = 0;
-  char *buf = NULL;
-  wtf_entry_t *list = NULL;
-
-  cvector_init(buf, 512, NULL);
-  cvector_init(list, 64, NULL);
 
-  read_to_vec(&buf, 255, stdin);
+  if (index_path)
+  {
+    corpus = wtf_corpus_open_index(index_path, in_delim);
+    if (!corpus)
+    {
+      fprintf(stderr, "wtf: %s: %s\n", index_path, errno == EINVAL ? "not a usable index file" : strerror(errno));
+      err = 2;
+      goto main_cleanup;
+    }
+  }
+  else
+  {
+    corpus = wtf_corpus_new(in_delim);
+    if (!corpus)
+    {
+      fprintf(stderr, "wtf: could not allocate input buffer\n");
+      err = 1;
+      goto main_cleanup;
+    }
+  }
 
   /*
-   * Split entries by newlines.
+   * The finder starts on piped input right away and keeps reading it as it runs,
+   * unless the initial query has to settle things (`-1`, `-0`) on all of it first.
    */
+  if (cvector_size(paths) == 0 && !index_path)
   {
-    size_t offset = 0;
-    size_t size = 0;
+    struct stat st;
+    finder_opts.stream = !filter && !daemon && !queries_path && !build_index
+      && !finder_opts.select_1 && !finder_opts.exit_0
+      && fstat(STDIN_FILENO, &st) == 0 && !S_ISREG(st.st_mode);
 
-    for (size_t i = 0; i < cvector_size(buf); i++)
+    if (!finder_opts.stream && !read_path(corpus, "-", NULL))
     {
-      char *ch = &buf[i];
-
-      if (*ch == '\n')
+      err = 2;
+      goto main_cleanup;
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < cvector_size(paths); i++)
+    {
+      if (!read_path(corpus, paths[i], daemon_path ? &follow : NULL))
       {
-        if (size > 0)
-        {
-          cvector_push_back(
-            list,
-            wtf_entry_new((char*)(buf + offset), size)
-          );
-          offset += size;
-          size = 0;
-        }
-        offset++;
-
-        // Null terminate just in case...
-        *ch = '\0';
+        err = 2;
+        goto main_cleanup;
       }
-      else size++;
     }
-
-    if (size > 0)
-      cvector_push_back(
-        list,
-        wtf_entry_new((char*)(buf + offset), size)
-      );
   }
 
-  wtf_entry_t *entry = finder_start(&list);
-  if (entry)
+  if (char_index && !wtf_corpus_build_char_index(corpus))
   {
-    printf("%.*s\n", (int)entry->label_sz, entry->label);
+    fprintf(stderr, "wtf: building the character index failed: %s\n", strerror(errno));
+    err = 1;
+    goto main_cleanup;
   }
-  else
+
+  if (trigram_index && !wtf_corpus_build_trigram_index(corpus))
   {
+    fprintf(stderr, "wtf: building the trigram index failed: %s\n", strerror(errno));
     err = 1;
+    goto main_cleanup;
+  }
+
+  if (build_index)
+  {
+    if (!wtf_corpus_write_index(corpus, index_out))
+    {
+      fprintf(stderr, "wtf: %s: %s\n", index_out, strerror(errno));
+      err = 2;
+    }
+    goto main_cleanup;
+  }
+
+  if (daemon)
+  {
+    struct stat st;
+    if (cvector_size(paths) == 0 && !index_path && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+      cvector_push_back(follow, STDIN_FILENO);
+
+    if (!daemon_run(corpus, follow, daemon_path)) err = 2;
+    goto main_cleanup;
+  }
+
+  if (queries_path)
+  {
+    wtf_corpus_t *queries = wtf_corpus_new('\n');
+
+    if (!queries
+        || !read_path(queries, queries_path, NULL)
+        || !batch_run(corpus, queries, limit ? limit : 10, &printer))
+      err = 2;
+
+    wtf_corpus_free(queries);
+    goto main_cleanup;
+  }
+
+  if (filter)
+  {
+    if (!filter_run(corpus, filter, limit, &printer)) err = 1;
+    goto main_cleanup;
+  }
+
+  {
+    wtf_local_t local = { .corpus = corpus, .query_ctx = wtf_ctx_new(FUZZ_MAX_INACCURACY) };
+    local.list = wtf_corpus_entries(corpus, &local.list_sz);
+    wtf_ranker_t ranker = local_ranker(&local);
+
+    if (!finder_start(&ranker, &printer, &finder_opts)) err = 1;
+
+    wtf_ctx_free(local.query_ctx);
   }
 
-  cvector_set_elem_destructor(list, (void (*)(void*))str_rate_free);
-  cvector_free(list);
-  cvector_free(buf);
+main_cleanup:
+  for (size_t i = 0; i < cvector_size(follow); i++)
+    if (follow[i] != STDIN_FILENO) close(follow[i]);
+
+  wtf_corpus_free(corpus);
+  cvector_free(paths);
+  cvector_free(follow);
+
+  if (show_stats) print_stats(stderr);
 
   return err;
 }
@@ -0,0 +1,211 @@
+/*
+ * libwtf - the matching engine behind wtf.
+ *
+ * Builds an in-memory corpus of entries (read from files, or pointing straight into
+ * the caller's own buffers), rates entries against a query and retrieves the best K.
+ *
+ * Entries never change once added. Any number of threads may rank the same corpus
+ * at once, each with its own `wtf_ctx_t`, as long as nothing is being added to it.
+ */
+#ifndef WTF_H
+#define WTF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped on every incompatible change to this header. */
+#define WTF_API_VERSION 1
+
+/*
+ * Counters kept by the library. Everything allocated through the wrappers below is
+ * counted, so callers can route their own allocations through them too.
+ * Counters touched by several threads are updated atomically. New ones are only
+ * ever added at the end.
+ */
+typedef struct
+{
+  size_t allocs;        /* malloc/calloc/realloc calls. */
+  size_t frees;
+  size_t corpus_bytes;  /* Bytes reserved by freed corpora for bookkeeping. */
+  size_t scratch_bytes; /* Bytes reserved by freed query contexts. */
+  size_t ingest_bytes;
+  size_t ingest_reads;  /* Reads needed to get them. */
+  size_t ingest_uring_reads; /* How many of them went through io_uring. */
+  double ingest_secs;
+  size_t index_bytes;     /* Bytes of index files mapped. */
+  double index_secs;      /* Time spent opening them. */
+  size_t signature_skips; /* Entries ruled out by their character signature. */
+  size_t postings_bytes;  /* Size of the last character index built. */
+  double postings_secs;   /* Time spent building character indexes. */
+  size_t postings_skips;  /* Entries ruled out by them. */
+  size_t trigram_bytes;   /* Size of the last trigram index built or loaded. */
+  double trigram_secs;    /* Time spent building trigram indexes. */
+  size_t trigram_queries; /* Queries answered through one. */
+  size_t trigram_skips;   /* Entries ruled out by them. */
+  size_t length_skips;    /* Matches never fully scored, being too far off in length. */
+}
+wtf_stats_t;
+
+extern wtf_stats_t wtf_stats;
+
+void *wtf_malloc(size_t sz);
+void *wtf_calloc(size_t n, size_t sz);
+void *wtf_realloc(void *ptr, size_t sz);
+void wtf_free(void *ptr);
+
+/* Allocations made through the wrappers by the calling thread alone, so far. */
+size_t wtf_thread_allocs(void);
+
+typedef struct
+{
+  const char *label;
+  size_t label_sz;
+}
+wtf_entry_t;
+
+/* Everything a query produces for one entry. Lower distances are better. */
+typedef struct
+{
+  const wtf_entry_t *entry;
+  int distance;
+  int inaccuracy; /* 2 for every query character missing from the label. */
+}
+wtf_match_t;
+
+/*
+ * CORPUS
+ */
+typedef struct wtf_corpus wtf_corpus_t;
+
+/* Entries are separated by `delim` in everything read or split into the corpus. */
+wtf_corpus_t *wtf_corpus_new(char delim);
+void wtf_corpus_free(wtf_corpus_t *corpus);
+
+/*
+ * Reads `fd` to the end into the corpus. Empty lines are skipped. Returns false (with
+ * `errno` set) if a read failed or memory ran out; whatever was read until then is kept.
+ */
+bool wtf_corpus_read_fd(wtf_corpus_t *corpus, int fd);
+
+/*
+ * Reads the file at `path` ("-" for STDIN), through io_uring where possible.
+ * With `keep_fd`, a regular file is left open and its descriptor stored there
+ * (-1 otherwise), so whatever gets appended later can be read with `wtf_corpus_read_fd`.
+ */
+bool wtf_corpus_read_path(wtf_corpus_t *corpus, const char *path, int *keep_fd);
+
+/*
+ * Copies `sz` bytes of input into the corpus, for input arriving in pieces (e.g. from
+ * a non-blocking pipe). A line cut off at the end waits for the rest; a NULL `buf`
+ * marks the end of input and turns it into an entry.
+ */
+bool wtf_corpus_feed(wtf_corpus_t *corpus, const char *buf, size_t sz);
+
+/*
+ * Zero-copy: the entries point into the caller's memory, which is never written to
+ * and must outlive the corpus. `wtf_corpus_add_lines` splits `buf` on the delimiter,
+ * skipping empty lines, and returns the number of entries added.
+ */
+void wtf_corpus_add(wtf_corpus_t *corpus, const char *label, size_t label_sz);
+size_t wtf_corpus_add_lines(wtf_corpus_t *corpus, const char *buf, size_t sz);
+
+/* All entries in input order. Only valid until more are added. */
+const wtf_entry_t *wtf_corpus_entries(const wtf_corpus_t *corpus, size_t *n);
+
+/*
+ * Builds an inverted index from every (folded) character to the entries holding it,
+ * as compressed bitmaps. Queries are then only scored against the entries holding
+ * all of their characters, unless the context tolerates missing ones. Covers the
+ * entries added so far; later ones are scanned as usual.
+ */
+bool wtf_corpus_build_char_index(wtf_corpus_t *corpus);
+
+/*
+ * Builds an inverted index from every (folded) trigram to the entries holding it.
+ * Exact queries of three characters or more are then only verified against the
+ * entries holding all of their trigrams. Covers the entries added so far, and does
+ * nothing if it already covers them all (e.g. when loaded from an index file).
+ */
+bool wtf_corpus_build_trigram_index(wtf_corpus_t *corpus);
+
+/*
+ * Index files hold a corpus ready to be mapped: labels, their offsets and lengths,
+ * case-folded text and per-entry character signatures, plus the trigram index if the
+ * corpus has one covering every entry. Opening one parses no text, and the mapping
+ * is shared with every other process using the same file, but it still takes a pass
+ * over the per-entry tables: every label's bounds are checked, and the corpus' entry
+ * array and length buckets are filled from them, as entries carry pointers.
+ *
+ * `wtf_corpus_write_index` replaces `path` atomically. `wtf_corpus_open_index` fails
+ * with EINVAL for files it can't use (corrupt, other version or byte order); more
+ * input can be added to the corpus afterwards, split on `delim`.
+ */
+bool wtf_corpus_write_index(const wtf_corpus_t *corpus, const char *path);
+wtf_corpus_t *wtf_corpus_open_index(const char *path, char delim);
+
+/*
+ * MATCHING
+ *
+ * A context holds the scratch memory of a scoring pass and is reused from one query
+ * to the next, so ranking doesn't touch the heap once it has warmed up.
+ * Entries missing more than `max_inaccuracy / 2` query characters don't match.
+ *
+ * A query starting with `'` is exact: only labels holding the rest of it as a
+ * substring (case-insensitively) match.
+ */
+typedef struct wtf_ctx wtf_ctx_t;
+
+wtf_ctx_t *wtf_ctx_new(int max_inaccuracy);
+void wtf_ctx_free(wtf_ctx_t *ctx);
+
+/*
+ * Called about every `interval_secs` while a pass ranks entries, with what it has so
+ * far: the `n` best matches in `ranked` (in no particular order, and only valid
+ * during the call), how many entries matched, and how many of the `total` were gone
+ * through. Returning false abandons the pass, which then returns what it had.
+ * Runs on the thread ranking. Pass a NULL `fn` to stop.
+ */
+typedef bool (*wtf_progress_fn)(void *arg, const wtf_match_t *ranked, size_t n, size_t matched, size_t done, size_t total);
+
+void wtf_ctx_set_progress(wtf_ctx_t *ctx, wtf_progress_fn fn, void *arg, double interval_secs);
+
+/* Rates a single entry. Returns whether it matches. */
+bool wtf_rate(wtf_ctx_t *ctx, const wtf_entry_t *entry, const char *query, size_t query_sz, wtf_match_t *match);
+
+/*
+ * Fills `ranked` with the entries matching the query, best first, and returns how many
+ * there are. An empty query matches everything, in input order.
+ *
+ * With a non-zero `limit` only the best `limit` are kept (top-K), otherwise `ranked`
+ * must have room for all `n` entries. `matched` (if not NULL) gets the number of all
+ * entries that matched.
+ */
+size_t wtf_rank(wtf_ctx_t *ctx, const wtf_entry_t *entries, size_t n, const char *query, size_t query_sz, size_t limit, wtf_match_t *ranked, size_t *matched);
+
+/* `wtf_rank` over a whole corpus, using whatever it was indexed with to skip entries early. */
+size_t wtf_corpus_rank(wtf_ctx_t *ctx, const wtf_corpus_t *corpus, const char *query, size_t query_sz, size_t limit, wtf_match_t *ranked, size_t *matched);
+
+/* Best first; ties keep input order as long as the entries share one array. */
+int wtf_match_cmp(const wtf_match_t *a, const wtf_match_t *b);
+
+/*
+ * Finds the next label position, from `*i` on, holding query character `*j`
+ * (case-insensitively). Moves both cursors past it and returns it, or -1 once
+ * the label or the query runs out.
+ *
+ * Starting with both cursors at 0, this walks the query characters in order,
+ * taking each one at its first occurrence (for exact queries, the characters of
+ * the first occurrence of the substring). These are the positions to highlight.
+ */
+ssize_t wtf_mark_next(const wtf_entry_t *entry, const char *query, size_t query_sz, size_t *i, size_t *j);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WTF_H */